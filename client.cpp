@@ -0,0 +1,256 @@
+/*
+client.cpp
+CSPB 1300 Image Processing Application
+
+A command line client for the job server started with "imageprocessor serve
+SOCKET". It sends one job, or the same job several times over one
+connection, and prints each reply. Build it on its own:
+
+    g++ -std=c++17 -O2 client.cpp -o imageprocessor-client
+*/
+
+#include <iostream>
+#include <vector>
+#include <fstream>
+#include <iterator>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+using namespace std;
+
+/**
+ * Connects to the server
+ * @param socket_path file name of the server's socket
+ * @return the connected socket, or -1 on failure
+ */
+int connect_to(const string& socket_path)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path))
+    {
+        return -1;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 && connect(fd, (struct sockaddr*)&address, sizeof(address)) != 0)
+    {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends all the bytes given, retrying short writes
+ * @param fd    the socket
+ * @param data  the bytes
+ * @param bytes the number of bytes
+ * @return True if everything was sent and false otherwise
+ */
+bool send_fully(int fd, const void* data, size_t bytes)
+{
+    const char* in = static_cast<const char*>(data);
+    while (bytes > 0)
+    {
+        ssize_t count = write(fd, in, bytes);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        in = in + count;
+        bytes = bytes - count;
+    }
+    return true;
+}
+
+/**
+ * Receives exactly the number of bytes asked for
+ * @param fd    the socket
+ * @param data  the buffer to fill
+ * @param bytes the number of bytes
+ * @return True if all bytes arrived and false otherwise
+ */
+bool receive_fully(int fd, void* data, size_t bytes)
+{
+    char* out = static_cast<char*>(data);
+    while (bytes > 0)
+    {
+        ssize_t count = read(fd, out, bytes);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        out = out + count;
+        bytes = bytes - count;
+    }
+    return true;
+}
+
+/**
+ * Receives one line, without the newline
+ * @param fd   the socket
+ * @param line receives the line
+ * @return True if a whole line arrived and false otherwise
+ */
+bool receive_line(int fd, string& line)
+{
+    line.clear();
+    char c;
+    while (receive_fully(fd, &c, 1))
+    {
+        if (c == '\n')
+        {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+/**
+ * Makes a relative path absolute, since the server does not share the client's directory
+ * @param path the path
+ * @return the absolute path
+ */
+string absolute(const string& path)
+{
+    char directory[PATH_MAX];
+    if (path.empty() || path[0] == '/' || getcwd(directory, sizeof(directory)) == nullptr)
+    {
+        return path;
+    }
+    return string(directory) + "/" + path;
+}
+
+int main(int argc, char* argv[])
+{
+    int arg = 2;
+    bool send_input = false;
+    bool receive_output = false;
+    int repeat = 1;
+    bool valid = argc > 1;
+    while (valid && argc > arg && string(argv[arg]).substr(0, 2) == "--")
+    {
+        string option = argv[arg];
+        if (option == "--send")
+        {
+            send_input = true;
+        }
+        else if (option == "--receive")
+        {
+            receive_output = true;
+        }
+        else if (option == "--repeat" && argc > arg + 1 && atoi(argv[arg + 1]) > 0)
+        {
+            repeat = atoi(argv[arg + 1]);
+            arg++;
+        }
+        else
+        {
+            valid = false;
+        }
+        arg++;
+    }
+
+    bool control = argc == arg + 1 && (string(argv[arg]) == "stats" || string(argv[arg]) == "shutdown");
+    if (!valid || (!control && argc < arg + 3))
+    {
+        cout << "Usage: " << argv[0] << " SOCKET [--send] [--receive] [--repeat N] INPUT OUTPUT PROCESS..." << endl;
+        cout << "       " << argv[0] << " SOCKET stats|shutdown" << endl;
+        cout << "--send sends the input file's bytes instead of its name; --receive gets the result" << endl;
+        cout << "back and writes OUTPUT here instead of having the server write it." << endl;
+        return 1;
+    }
+
+    // The request line, and the input bytes to follow it if they are sent inline
+    string request;
+    vector<char> input;
+    if (control)
+    {
+        request = argv[arg];
+    }
+    else
+    {
+        if (send_input)
+        {
+            ifstream file(argv[arg], ios::binary);
+            if (!file)
+            {
+                cout << "Error: cannot read " << argv[arg] << endl;
+                return 1;
+            }
+            input.assign(istreambuf_iterator<char>(file), istreambuf_iterator<char>());
+        }
+        request = send_input ? "-" : absolute(argv[arg]);
+        request = request + " " + (receive_output ? "-" : absolute(argv[arg + 1]));
+        for (int k = arg + 2; k < argc; k++)
+        {
+            request = request + " " + argv[k];
+        }
+    }
+    request = request + "\n";
+
+    int fd = connect_to(argv[1]);
+    if (fd < 0)
+    {
+        cout << "Error: cannot connect to " << argv[1] << endl;
+        return 1;
+    }
+    // A server that closes the connection early must not kill the client before it reads the reply
+    signal(SIGPIPE, SIG_IGN);
+
+    int status = 0;
+    for (int run = 0; run < repeat && status == 0; run++)
+    {
+        string count = to_string(input.size()) + "\n";
+        string reply;
+        // The server may refuse the input before taking it all, so its reply is read even then
+        bool sent = send_fully(fd, request.data(), request.size())
+                    && (!send_input || (send_fully(fd, count.data(), count.size())
+                                        && send_fully(fd, input.data(), input.size())));
+        if (!receive_line(fd, reply))
+        {
+            cout << "Error: connection lost" << endl;
+            return 1;
+        }
+        cout << reply << endl;
+        status = sent && reply.substr(0, 3) == "ok " ? 0 : 1;
+
+        if (status == 0 && receive_output && !control)
+        {
+            string size;
+            vector<char> output;
+            if (!receive_line(fd, size))
+            {
+                cout << "Error: connection lost" << endl;
+                return 1;
+            }
+            output.resize(strtoull(size.c_str(), nullptr, 10));
+            ofstream file(argv[arg + 1], ios::binary);
+            if (!receive_fully(fd, output.data(), output.size())
+                || !file.write(output.data(), output.size()))
+            {
+                cout << "Error: cannot write " << argv[arg + 1] << endl;
+                return 1;
+            }
+        }
+    }
+    close(fd);
+    return status;
+}
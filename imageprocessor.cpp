@@ -0,0 +1,5233 @@
+/*
+imageprocessor.cpp
+CSPB 1300 Image Processing Application
+
+The image processing engine declared in imageprocessor.h.
+*/
+
+#include "imageprocessor.h"
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <list>
+#include <map>
+#include <fstream>
+#include <cmath>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <exception>
+#include <string>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <sstream>
+#include <ctime>
+#include <fcntl.h>
+#include <glob.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <csignal>
+#include <set>
+using namespace std;
+
+namespace imageprocessor
+{
+
+int api_version()
+{
+    return 100 * IMAGEPROCESSOR_VERSION_MAJOR + IMAGEPROCESSOR_VERSION_MINOR;
+}
+
+//***************************************************************************************************//
+//                                    PACKED IMAGE BUFFER                                            //
+//***************************************************************************************************//
+
+BufferPool& buffer_pool()
+{
+    static BufferPool* pool = new BufferPool;
+    return *pool;
+}
+
+//***************************************************************************************************//
+//                                    INSTRUMENTATION                                                //
+//***************************************************************************************************//
+
+// Time and work of one stage of a job: a read, a process or a write
+struct StageMetrics
+{
+    string stage;
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    unsigned long long bytes_read = 0;
+    unsigned long long bytes_written = 0;
+    unsigned long long pixels = 0;
+};
+
+// Everything measured for one job: a menu selection, a command or one image of a batch
+struct JobMetrics
+{
+    string job;
+    vector<StageMetrics> stages;
+    double wall_seconds = 0;
+    double cpu_seconds = 0;
+    atomic<long long> cpu_ns{0};                    // CPU time charged so far by every thread working for the job
+    atomic<unsigned long long> allocations{0};      // image buffers newly allocated
+    atomic<unsigned long long> reuses{0};           // image buffers recycled from the pool
+    long long process_peak_rss_bytes = 0;           // high-water mark of the whole process when the job ended
+    thread::id owner;                               // the thread measuring the job, which times its stages
+};
+
+/**
+ * Collects job metrics and exports them, either as one JSON object per job
+ * per line, appended as each job finishes, or as a Prometheus text file of
+ * running totals, rewritten as each job finishes. Nothing is measured unless
+ * enable_metrics() has been called: every hook checks one flag first.
+ */
+class MetricsSink
+{
+public:
+    bool enabled() const { return enabled_; }
+
+    /**
+     * Starts collecting metrics
+     * @param filename   file to export to (overwritten)
+     * @param prometheus True for the Prometheus text format, false for JSON lines
+     * @return True if the file could be written and false otherwise
+     */
+    bool enable(const string& filename, bool prometheus)
+    {
+        filename_ = filename;
+        prometheus_ = prometheus;
+        ofstream file(filename);
+        enabled_ = bool(file);
+        return enabled_;
+    }
+
+    /**
+     * Exports a finished job
+     * @param job the job
+     * @return nothing
+     */
+    void record(const JobMetrics& job)
+    {
+        lock_guard<mutex> guard(lock_);
+        jobs_++;
+        peak_rss_bytes_ = max(peak_rss_bytes_, job.process_peak_rss_bytes);
+        allocations_ = allocations_ + job.allocations;
+        for (size_t k = 0; k < job.stages.size(); k++)
+        {
+            const StageMetrics& stage = job.stages[k];
+            StageMetrics& total = totals_[stage.stage];
+            total.wall_seconds = total.wall_seconds + stage.wall_seconds;
+            total.cpu_seconds = total.cpu_seconds + stage.cpu_seconds;
+            total.bytes_read = total.bytes_read + stage.bytes_read;
+            total.bytes_written = total.bytes_written + stage.bytes_written;
+            total.pixels = total.pixels + stage.pixels;
+            calls_[stage.stage]++;
+        }
+        if (prometheus_)
+        {
+            write_prometheus();
+        }
+        else
+        {
+            ofstream file(filename_, ios::app);
+            file << to_json(job) << "\n";
+        }
+    }
+
+private:
+    // Quotes a name, which may hold any bytes of a path, as a JSON string or, with
+    // prometheus set, as a label value, where the only escapes are \\, \" and \n
+    // and any other control character becomes a space
+    static string quoted(const string& text, bool prometheus = false)
+    {
+        string out = "\"";
+        for (size_t k = 0; k < text.size(); k++)
+        {
+            unsigned char c = text[k];
+            if (c == '"' || c == '\\')
+            {
+                out = out + '\\' + char(c);
+            }
+            else if (c == '\n')
+            {
+                out += "\\n";
+            }
+            else if (c < 0x20 && prometheus)
+            {
+                out += ' ';
+            }
+            else if (c == '\t' || c == '\r')
+            {
+                out += c == '\t' ? "\\t" : "\\r";
+            }
+            else if (c < 0x20)
+            {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", c);
+                out += code;
+            }
+            else
+            {
+                out += char(c);
+            }
+        }
+        return out + "\"";
+    }
+
+    static string to_json(const JobMetrics& job)
+    {
+        unsigned long long bytes_read = 0;
+        unsigned long long bytes_written = 0;
+        unsigned long long pixels = 0;
+        ostringstream stages;
+        for (size_t k = 0; k < job.stages.size(); k++)
+        {
+            const StageMetrics& stage = job.stages[k];
+            bytes_read = bytes_read + stage.bytes_read;
+            bytes_written = bytes_written + stage.bytes_written;
+            pixels = pixels + stage.pixels;
+            stages << (k == 0 ? "" : ",") << "{\"stage\":" << quoted(stage.stage) << ",\"wall_s\":"
+                   << stage.wall_seconds << ",\"cpu_s\":" << stage.cpu_seconds << ",\"bytes_read\":"
+                   << stage.bytes_read << ",\"bytes_written\":" << stage.bytes_written << ",\"pixels\":"
+                   << stage.pixels << "}";
+        }
+        ostringstream json;
+        json << "{\"job\":" << quoted(job.job) << ",\"wall_s\":" << job.wall_seconds << ",\"cpu_s\":"
+             << job.cpu_seconds << ",\"bytes_read\":" << bytes_read << ",\"bytes_written\":" << bytes_written
+             << ",\"pixels\":" << pixels << ",\"allocations\":" << job.allocations.load() << ",\"buffer_reuses\":"
+             << job.reuses.load() << ",\"process_peak_rss_bytes\":" << job.process_peak_rss_bytes << ",\"stages\":["
+             << stages.str() << "]}";
+        return json.str();
+    }
+
+    void write_prometheus() const
+    {
+        ofstream file(filename_);
+        file << "# TYPE imageprocessor_jobs_total counter\n";
+        file << "imageprocessor_jobs_total " << jobs_ << "\n";
+        file << "# TYPE imageprocessor_image_allocations_total counter\n";
+        file << "imageprocessor_image_allocations_total " << allocations_ << "\n";
+        file << "# TYPE imageprocessor_process_peak_rss_bytes gauge\n";
+        file << "imageprocessor_process_peak_rss_bytes " << peak_rss_bytes_ << "\n";
+        const char* names[] = {"stage_calls_total", "stage_wall_seconds_total", "stage_cpu_seconds_total",
+                               "stage_bytes_read_total", "stage_bytes_written_total", "stage_pixels_total"};
+        for (int metric = 0; metric < 6; metric++)
+        {
+            file << "# TYPE imageprocessor_" << names[metric] << " counter\n";
+            for (auto entry = totals_.begin(); entry != totals_.end(); ++entry)
+            {
+                const StageMetrics& total = entry->second;
+                file << "imageprocessor_" << names[metric] << "{stage=" << quoted(entry->first, true) << "} ";
+                switch (metric)
+                {
+                    case 0: file << calls_.at(entry->first); break;
+                    case 1: file << total.wall_seconds; break;
+                    case 2: file << total.cpu_seconds; break;
+                    case 3: file << total.bytes_read; break;
+                    case 4: file << total.bytes_written; break;
+                    case 5: file << total.pixels; break;
+                }
+                file << "\n";
+            }
+        }
+    }
+
+    bool enabled_ = false;
+    bool prometheus_ = false;
+    string filename_;
+    mutex lock_;
+    unsigned long long jobs_ = 0;
+    unsigned long long allocations_ = 0;
+    long long peak_rss_bytes_ = 0;
+    map<string, StageMetrics> totals_;
+    map<string, unsigned long long> calls_;
+};
+
+MetricsSink& metrics()
+{
+    static MetricsSink sink;
+    return sink;
+}
+
+bool enable_metrics(const string& filename)
+{
+    bool prometheus = filename.size() >= 5 && filename.substr(filename.size() - 5) == ".prom";
+    return metrics().enable(filename, prometheus);
+}
+
+// The job the calling thread is measuring, if any
+JobMetrics*& current_job_metrics()
+{
+    static thread_local JobMetrics* job = nullptr;
+    return job;
+}
+
+// CPU time of the calling thread
+long long thread_cpu_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+// The calling thread's CPU time when it last charged its job
+long long& thread_cpu_mark()
+{
+    static thread_local long long mark = 0;
+    return mark;
+}
+
+/**
+ * Charges the CPU time the calling thread has used since it last did so to
+ * the job it is working for, if any, and then works for another. Pool
+ * threads switch to the job of each task they run and back, so a job is
+ * charged for every thread's work on it and for nothing else.
+ * @param job the job to work for next (may be the current one, or null)
+ * @return nothing
+ */
+void switch_job_metrics(JobMetrics* job)
+{
+    JobMetrics* current = current_job_metrics();
+    if (current == nullptr && job == nullptr)
+    {
+        return;
+    }
+    long long now = thread_cpu_ns();
+    if (current != nullptr)
+    {
+        current->cpu_ns += now - thread_cpu_mark();
+    }
+    thread_cpu_mark() = now;
+    current_job_metrics() = job;
+}
+
+void count_buffer(bool reused)
+{
+    JobMetrics* job = current_job_metrics();
+    if (job != nullptr)
+    {
+        (reused ? job->reuses : job->allocations)++;
+    }
+}
+
+double wall_seconds()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+JobScope::JobScope(const string& job) : previous_(nullptr)
+{
+    if (!metrics().enabled())
+    {
+        return;
+    }
+    job_.reset(new JobMetrics);
+    job_->job = job;
+    job_->owner = this_thread::get_id();
+    previous_ = current_job_metrics();
+    switch_job_metrics(job_.get());
+    wall_start_ = wall_seconds();
+}
+
+JobScope::~JobScope()
+{
+    if (!job_)
+    {
+        return;
+    }
+    job_->wall_seconds = wall_seconds() - wall_start_;
+    switch_job_metrics(previous_);
+    job_->cpu_seconds = job_->cpu_ns / 1e9;
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        job_->process_peak_rss_bytes = (long long)usage.ru_maxrss * 1024;
+    }
+    if (!job_->stages.empty())
+    {
+        metrics().record(*job_);
+    }
+}
+
+/**
+ * Measures one stage from construction to destruction and adds it to the
+ * job being measured on this thread. Does nothing, and costs one test of a
+ * pointer, when there is no such job. A pool thread running a task for a
+ * job measured on another thread does not time stages of it.
+ */
+class StageTimer
+{
+public:
+    explicit StageTimer(const char* stage) : job_(current_job_metrics())
+    {
+        if (job_ != nullptr && job_->owner != this_thread::get_id())
+        {
+            job_ = nullptr;
+        }
+        if (job_ != nullptr)
+        {
+            stage_.stage = stage;
+            wall_start_ = wall_seconds();
+            switch_job_metrics(job_);
+            cpu_start_ = job_->cpu_ns;
+        }
+    }
+
+    ~StageTimer()
+    {
+        if (job_ != nullptr)
+        {
+            stage_.wall_seconds = wall_seconds() - wall_start_;
+            switch_job_metrics(job_);
+            stage_.cpu_seconds = (job_->cpu_ns - cpu_start_) / 1e9;
+            job_->stages.push_back(stage_);
+        }
+    }
+
+    StageTimer(const StageTimer&) = delete;
+    StageTimer& operator=(const StageTimer&) = delete;
+
+    bool active() const { return job_ != nullptr; }
+    void rename(const string& stage) { stage_.stage = stage; }
+    void add_read(unsigned long long bytes) { stage_.bytes_read = stage_.bytes_read + bytes; }
+    void add_written(unsigned long long bytes) { stage_.bytes_written = stage_.bytes_written + bytes; }
+    void add_pixels(unsigned long long pixels) { stage_.pixels = stage_.pixels + pixels; }
+
+private:
+    JobMetrics* job_;
+    StageMetrics stage_;
+    double wall_start_ = 0;
+    long long cpu_start_ = 0;
+};
+
+//***************************************************************************************************//
+//                                    BMP FILE INPUT AND OUTPUT                                      //
+//***************************************************************************************************//
+
+/**
+ * Reads exactly the number of bytes asked for, retrying short reads.
+ * Helper function for read_image()
+ * @param fd     the file descriptor
+ * @param buffer the buffer to fill
+ * @param bytes  the number of bytes to read
+ * @return True if all bytes were read and false otherwise
+ */
+bool read_fully(int fd, void* buffer, size_t bytes)
+{
+    char* out = static_cast<char*>(buffer);
+    while (bytes > 0)
+    {
+        ssize_t count = read(fd, out, bytes);
+        if (count < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (count <= 0)
+        {
+            return false;
+        }
+        out = out + count;
+        bytes = bytes - count;
+    }
+    return true;
+}
+
+/**
+ * Fills a list of buffers from a file with as few readv() calls as possible.
+ * Helper function for read_image()
+ * @param fd    the file descriptor
+ * @param iov   the buffers to fill, in file order (modified)
+ * @param count the number of buffers
+ * @return True if all buffers were filled and false otherwise
+ */
+bool readv_fully(int fd, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t done = readv(fd, iov, min(count, IOV_MAX));
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        // Skip the buffers that were filled and trim a partly filled one
+        while (count > 0 && size_t(done) >= iov->iov_len)
+        {
+            done = done - iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len = iov->iov_len - done;
+        }
+    }
+    return true;
+}
+
+/**
+ * Gets an unsigned integer from a buffer holding the start of a BMP file.
+ * Helper function for parse_bmp_header()
+ * @param header the buffer
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+uint32_t get_uint(const unsigned char header[], int offset, int bytes)
+{
+    uint32_t result = 0;
+    for (int i = 0; i < bytes; i++)
+    {
+        result = result | (uint32_t(header[offset + i]) << (8*i));
+    }
+    return result;
+}
+
+/**
+ * Gets a signed integer from a buffer holding the start of a BMP file.
+ * Helper function for parse_bmp_header()
+ * @param header the buffer
+ * @param offset the offset at which to read the integer
+ * @param bytes  the number of bytes to read
+ * @return the integer starting at the given offset
+ */
+int get_int(const unsigned char header[], int offset, int bytes)
+{
+    return int(get_uint(header, offset, bytes));
+}
+
+// Bytes of a BMP file needed to validate it and locate the pixel array
+const int BMP_HEADER_BYTES = 54;
+
+// Layout of a BMP file's pixel array, with 64-bit offsets
+struct BmpInfo
+{
+    int width;
+    int height;
+    int bytes_per_pixel;
+    int64_t start;          // offset of the pixel array in the file
+    int64_t row_bytes;      // scan line size including padding
+    int64_t file_size;      // size the pixel array says the file has
+};
+
+/**
+ * Validates the headers of a BMP file and works out its layout.
+ * A file is valid when its size field matches the pixel array the same way
+ * read_image() has always checked. The size field is only 32 bits, so for
+ * files past 4 GiB it is compared modulo 2^32 and the real size is checked
+ * as well. Dimensions whose pixel array would not fit in a 64-bit offset are
+ * refused before its size is worked out.
+ * @param header      the first BMP_HEADER_BYTES of the file
+ * @param actual_size the real size of the file in bytes
+ * @param info        receives the layout
+ * @return True if the file is a readable 24- or 32-bit BMP and false otherwise
+ */
+bool parse_bmp_header(const unsigned char header[], int64_t actual_size, BmpInfo& info)
+{
+    info.width = get_int(header, 18, 4);
+    info.height = get_int(header, 22, 4);
+    int bits_per_pixel = get_uint(header, 28, 2);
+    info.bytes_per_pixel = bits_per_pixel / 8;
+    info.start = get_uint(header, 10, 4);
+    if (info.width <= 0 || info.height <= 0 || (bits_per_pixel != 24 && bits_per_pixel != 32))
+    {
+        return false;
+    }
+
+    // Scan lines must occupy multiples of four bytes
+    int64_t scanline_size = int64_t(info.width) * info.bytes_per_pixel;
+    info.row_bytes = scanline_size + (4 - scanline_size % 4) % 4;
+
+    // A pixel array too big for a 64-bit offset cannot be in any file
+    if (info.height > (INT64_MAX - info.start) / info.row_bytes)
+    {
+        return false;
+    }
+    info.file_size = info.start + info.row_bytes * info.height;
+
+    return get_uint(header, 2, 4) == uint32_t(info.file_size) && actual_size >= info.file_size
+        && info.start >= BMP_HEADER_BYTES;
+}
+
+/**
+ * Copies one scan line into a row of packed pixels, dropping any alpha channel.
+ * Helper function for the BMP readers
+ * @param src             the scan line
+ * @param dst             the packed row (may be the scan line itself when it has alpha)
+ * @param width           number of pixels
+ * @param bytes_per_pixel 3 or 4
+ * @return nothing
+ */
+void unpack_scanline(const uint8_t* src, uint8_t* dst, int width, int bytes_per_pixel)
+{
+    if (bytes_per_pixel == Image::CHANNELS)
+    {
+        memcpy(dst, src, size_t(width) * Image::CHANNELS);
+        return;
+    }
+    for (int j = 0; j < width; j++)
+    {
+        dst[3*j] = src[bytes_per_pixel*j];
+        dst[3*j + 1] = src[bytes_per_pixel*j + 1];
+        dst[3*j + 2] = src[bytes_per_pixel*j + 2];
+    }
+}
+
+// Scan lines read per batch when decoding the pixel array
+const int READ_BATCH_ROWS = 512;
+
+bool read_image(const string& filename, Image& image)
+{
+    StageTimer timer("read_image");
+    image = Image();
+
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    // Get the image properties and fail if this is not a valid image
+    unsigned char header[BMP_HEADER_BYTES];
+    struct stat file_status;
+    BmpInfo info;
+    if (!read_fully(fd, header, BMP_HEADER_BYTES) || fstat(fd, &file_status) != 0
+        || !parse_bmp_header(header, file_status.st_size, info)
+        || lseek(fd, info.start, SEEK_SET) != info.start)
+    {
+        close(fd);
+        return false;
+    }
+
+    int width = info.width;
+    int height = info.height;
+    size_t row_bytes = info.row_bytes;
+    Image result = Image::uninitialized(width, height);
+    bool direct = info.bytes_per_pixel == Image::CHANNELS && result.stride() >= row_bytes;
+    vector<struct iovec> iov;
+    vector<uint8_t> staging;
+    if (direct)
+    {
+        iov.resize(READ_BATCH_ROWS);
+    }
+    else
+    {
+        staging.resize(row_bytes * READ_BATCH_ROWS);
+    }
+
+    // BMP files store pixels from bottom to top, so file row r is image row (height - 1 - r)
+    bool ok = true;
+    for (int first = 0; first < height && ok; first = first + READ_BATCH_ROWS)
+    {
+        int rows = min(READ_BATCH_ROWS, height - first);
+        if (direct)
+        {
+            // Padded scan lines fit in the stride, so read them in place
+            for (int r = 0; r < rows; r++)
+            {
+                iov[r].iov_base = result.row(height - 1 - (first + r));
+                iov[r].iov_len = row_bytes;
+            }
+            ok = readv_fully(fd, iov.data(), rows);
+        }
+        else
+        {
+            ok = read_fully(fd, staging.data(), row_bytes * rows);
+            for (int r = 0; r < rows && ok; r++)
+            {
+                unpack_scanline(staging.data() + row_bytes * r, result.row(height - 1 - (first + r)),
+                                width, info.bytes_per_pixel);
+            }
+        }
+    }
+
+    close(fd);
+    if (!ok)
+    {
+        return false;
+    }
+    timer.add_read(file_status.st_size);
+    timer.add_pixels((unsigned long long)width * height);
+    image = move(result);
+    return true;
+}
+
+/**
+ * A BMP file mapped read-only into memory, so its pixel array can be used in
+ * place. Pages are only read from disk when they are first touched, and all
+ * offsets are 64 bits so files past 2 GiB work.
+ */
+class MappedBmp
+{
+public:
+    MappedBmp() : map_(nullptr), map_size_(0), info_()
+    {
+    }
+
+    ~MappedBmp()
+    {
+        close();
+    }
+
+    MappedBmp(const MappedBmp&) = delete;
+    MappedBmp& operator=(const MappedBmp&) = delete;
+
+    /**
+     * Maps a BMP file, replacing any file mapped before
+     * @param filename BMP image filename
+     * @return True if the file is a valid BMP image and false otherwise
+     */
+    bool open(const string& filename)
+    {
+        close();
+        int fd = ::open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+        {
+            return false;
+        }
+        struct stat file_status;
+        if (fstat(fd, &file_status) != 0 || file_status.st_size < BMP_HEADER_BYTES)
+        {
+            ::close(fd);
+            return false;
+        }
+        void* map = mmap(nullptr, file_status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (map == MAP_FAILED)
+        {
+            return false;
+        }
+        map_ = static_cast<uint8_t*>(map);
+        map_size_ = file_status.st_size;
+        if (!parse_bmp_header(map_, map_size_, info_))
+        {
+            close();
+            return false;
+        }
+        // The pixel array is usually walked once from one end to the other
+        madvise(map_, map_size_, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    /**
+     * Unmaps the file, invalidating any views of it
+     */
+    void close()
+    {
+        if (map_ != nullptr)
+        {
+            munmap(map_, map_size_);
+        }
+        map_ = nullptr;
+        map_size_ = 0;
+        info_ = BmpInfo();
+    }
+
+    bool is_open() const { return map_ != nullptr; }
+    int width() const { return info_.width; }
+    int height() const { return info_.height; }
+    int bytes_per_pixel() const { return info_.bytes_per_pixel; }
+
+    // The pixel array as stored: bottom-up scan lines of row_bytes() each, padding included
+    const uint8_t* pixel_array() const { return map_ + info_.start; }
+    int64_t row_bytes() const { return info_.row_bytes; }
+
+    // Only 24-bit pixel arrays have the packed layout a view needs
+    bool has_view() const { return is_open() && info_.bytes_per_pixel == Image::CHANNELS; }
+
+    /**
+     * Views the pixel array in place, top row first, by walking the
+     * bottom-up scan lines with a negative stride
+     * @return the view, or an empty view if has_view() is false
+     */
+    ImageView view() const
+    {
+        if (!has_view())
+        {
+            return ImageView();
+        }
+        const uint8_t* top = pixel_array() + info_.row_bytes * (info_.height - 1);
+        return ImageView(top, info_.width, info_.height, -info_.row_bytes);
+    }
+
+    /**
+     * Copies the pixel array into a packed image, for files without a view
+     * or callers that need to modify the pixels
+     * @param image receives the image
+     * @return True if successful and false otherwise
+     */
+    bool decode(Image& image) const
+    {
+        if (!is_open())
+        {
+            image = Image();
+            return false;
+        }
+        Image result = Image::uninitialized(info_.width, info_.height);
+        for (int i = 0; i < info_.height; i++)
+        {
+            const uint8_t* src = pixel_array() + info_.row_bytes * (info_.height - 1 - i);
+            unpack_scanline(src, result.row(i), info_.width, info_.bytes_per_pixel);
+        }
+        image = move(result);
+        return true;
+    }
+
+private:
+    uint8_t* map_;
+    size_t map_size_;
+    BmpInfo info_;
+};
+
+/**
+ * Opens a BMP file for read-only processing. 24-bit files are viewed in place
+ * through the mapping without copying; other files are decoded into a copy.
+ * @param filename BMP image filename
+ * @param mapped   receives the mapping, which must outlive the view
+ * @param decoded  receives the copy when one is needed
+ * @return the view of the image, or an empty view if the file is not valid
+ */
+ImageView open_input(const string& filename, MappedBmp& mapped, Image& decoded)
+{
+    StageTimer timer("read_image");
+    decoded = Image();
+    if (!mapped.open(filename))
+    {
+        return ImageView();
+    }
+    // A mapped file is only read as it is processed, but all of it will be
+    timer.add_read((unsigned long long)mapped.row_bytes() * mapped.height());
+    timer.add_pixels((unsigned long long)mapped.width() * mapped.height());
+    if (mapped.has_view())
+    {
+        return mapped.view();
+    }
+    mapped.decode(decoded);
+    mapped.close();
+    return decoded;
+}
+
+// An input image kept open by an ImageCache: a mapping of the file, or a decoded copy
+struct CachedImage
+{
+    MappedBmp mapped;
+    Image decoded;
+    ImageView view;
+};
+
+struct ImageCache::State
+{
+    struct Key
+    {
+        string path;
+        dev_t device;
+        ino_t inode;
+        off_t size;
+        time_t mtime_sec;
+        long mtime_nsec;
+
+        bool operator==(const Key& other) const
+        {
+            return path == other.path && device == other.device && inode == other.inode && size == other.size
+                   && mtime_sec == other.mtime_sec && mtime_nsec == other.mtime_nsec;
+        }
+    };
+
+    struct Entry
+    {
+        Key key;
+        shared_ptr<const CachedImage> image;
+        size_t bytes;
+    };
+
+    size_t budget;
+    size_t used = 0;
+    size_t hits = 0;
+    size_t misses = 0;
+    list<Entry> entries;        // most recently used first
+};
+
+ImageCache::ImageCache(size_t budget_bytes) : state_(new State)
+{
+    state_->budget = budget_bytes;
+}
+
+ImageCache::~ImageCache()
+{
+}
+
+shared_ptr<const ImageView> ImageCache::open(const string& filename)
+{
+    State& state = *state_;
+    struct stat status;
+    if (stat(filename.c_str(), &status) != 0)
+    {
+        return nullptr;
+    }
+    State::Key key{filename, status.st_dev, status.st_ino, status.st_size,
+                   status.st_mtim.tv_sec, status.st_mtim.tv_nsec};
+    for (auto entry = state.entries.begin(); entry != state.entries.end(); ++entry)
+    {
+        if (entry->key == key)
+        {
+            state.entries.splice(state.entries.begin(), state.entries, entry);
+            state.hits++;
+            const shared_ptr<const CachedImage>& image = state.entries.front().image;
+            return shared_ptr<const ImageView>(image, &image->view);
+        }
+    }
+
+    state.misses++;
+    shared_ptr<CachedImage> image = make_shared<CachedImage>();
+    image->view = open_input(filename, image->mapped, image->decoded);
+    if (image->view.empty())
+    {
+        return nullptr;
+    }
+    size_t bytes = size_t(image->view.width()) * image->view.height() * Image::CHANNELS;
+    if (bytes <= state.budget)
+    {
+        // A stale entry for the same path is dropped along with the least recently used
+        state.entries.remove_if([&](const State::Entry& entry) {
+            bool stale = entry.key.path == filename;
+            state.used = state.used - (stale ? entry.bytes : 0);
+            return stale;
+        });
+        while (state.used + bytes > state.budget)
+        {
+            state.used = state.used - state.entries.back().bytes;
+            state.entries.pop_back();
+        }
+        state.entries.push_front(State::Entry{key, image, bytes});
+        state.used = state.used + bytes;
+    }
+    // The view shares ownership of the mapping or copy behind it
+    return shared_ptr<const ImageView>(image, &image->view);
+}
+
+size_t ImageCache::used_bytes() const { return state_->used; }
+size_t ImageCache::hits() const { return state_->hits; }
+size_t ImageCache::misses() const { return state_->misses; }
+
+/**
+ * Writes a list of buffers to a file with as few writev() calls as possible.
+ * Helper function for write_image()
+ * @param fd    the file descriptor
+ * @param iov   the buffers to write, in file order (modified)
+ * @param count the number of buffers
+ * @return True if everything was written and false otherwise
+ */
+bool writev_fully(int fd, struct iovec* iov, int count)
+{
+    while (count > 0)
+    {
+        ssize_t done = writev(fd, iov, min(count, IOV_MAX));
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return false;
+        }
+        // Skip the buffers that were written and trim a partly written one
+        while (count > 0 && size_t(done) >= iov->iov_len)
+        {
+            done = done - iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = static_cast<char*>(iov->iov_base) + done;
+            iov->iov_len = iov->iov_len - done;
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes exactly the number of bytes given, retrying short writes.
+ * Helper function for the BMP writers
+ * @param fd     the file descriptor
+ * @param buffer the bytes to write
+ * @param bytes  the number of bytes to write
+ * @return True if everything was written and false otherwise
+ */
+bool write_fully(int fd, const void* buffer, size_t bytes)
+{
+    struct iovec iov;
+    iov.iov_base = const_cast<void*>(buffer);
+    iov.iov_len = bytes;
+    return writev_fully(fd, &iov, 1);
+}
+
+// Size of the BMP and DIB headers written by write_image()
+const int BMP_HEADER_SIZE = 14;
+const int DIB_HEADER_SIZE = 40;
+const int HEADERS_SIZE = BMP_HEADER_SIZE + DIB_HEADER_SIZE;
+
+/**
+ * Stores an integer in a buffer of header bytes, least significant byte first.
+ * Helper function for make_bmp_header()
+ * @param header the buffer
+ * @param offset the offset at which to store the integer
+ * @param bytes  the number of bytes to store
+ * @param value  the integer
+ * @return nothing
+ */
+void put_uint(unsigned char header[], int offset, int bytes, uint32_t value)
+{
+    for (int i = 0; i < bytes; i++)
+    {
+        header[offset + i] = (unsigned char)(value >> (8*i));
+    }
+}
+
+/**
+ * Fills in the BMP and DIB headers of a 24-bit BMP file.
+ * Helper function for write_image()
+ * @param header        receives the HEADERS_SIZE header bytes
+ * @param width_pixels  width of the image in pixels
+ * @param height_pixels height of the image in pixels
+ * @return nothing
+ */
+void make_bmp_header(unsigned char header[], int width_pixels, int height_pixels)
+{
+    // Calculate the width in bytes incorporating padding (4 byte alignment)
+    int64_t width_bytes = int64_t(width_pixels) * 3;
+    width_bytes = width_bytes + (4 - width_bytes % 4) % 4;
+
+    // Pixel array size in bytes, including padding. The size fields are only
+    // 32 bits, so past 4 GiB they wrap, which is what parse_bmp_header() expects
+    int64_t array_bytes = width_bytes * height_pixels;
+    int file_size_field = int(uint32_t(HEADERS_SIZE + array_bytes));
+    int array_size_field = int(uint32_t(array_bytes));
+
+    memset(header, 0, HEADERS_SIZE);
+    unsigned char* bmp_header = header;
+    unsigned char* dib_header = header + BMP_HEADER_SIZE;
+
+    // BMP Header
+    put_uint(bmp_header,  0, 1, 'B');              // ID field
+    put_uint(bmp_header,  1, 1, 'M');              // ID field
+    put_uint(bmp_header,  2, 4, file_size_field);  // Size of BMP file
+    put_uint(bmp_header, 10, 4, HEADERS_SIZE);     // Pixel array offset
+
+    // DIB Header
+    put_uint(dib_header,  0, 4, DIB_HEADER_SIZE);  // DIB header size
+    put_uint(dib_header,  4, 4, width_pixels);     // Width of bitmap in pixels
+    put_uint(dib_header,  8, 4, height_pixels);    // Height of bitmap in pixels
+    put_uint(dib_header, 12, 2, 1);                // Number of color planes
+    put_uint(dib_header, 14, 2, 24);               // Number of bits per pixel
+    put_uint(dib_header, 20, 4, array_size_field); // Size of raw bitmap data (including padding)
+    put_uint(dib_header, 24, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+    put_uint(dib_header, 28, 4, 2835);             // Print resolution of image (2835 pixels/meter)
+}
+
+// Scan lines gathered per writev() call (each one may need a padding buffer too)
+const int WRITE_BATCH_ROWS = 500;
+
+// Numbers the temporary files outputs are written to, so no two threads share one
+atomic<unsigned> temp_files{0};
+
+// A file being written by open_output()
+struct OutputFile
+{
+    string name;        // the file wanted
+    string written;     // the file being written, a temporary one when it replaces the file wanted
+    int fd;
+};
+
+/**
+ * Opens a file to write an image to. A regular file is replaced by renaming
+ * a temporary file beside it over it when it is closed, so any mapping of
+ * the old file (such as the job server's cached inputs) keeps its own pages
+ * instead of seeing the file truncated. Anything else, such as a pipe or a
+ * device, is written in place.
+ * Helper function for the BMP writers
+ * @param filename the file to write
+ * @param output   receives the open file
+ * @return True if the file could be opened and false otherwise
+ */
+bool open_output(const string& filename, OutputFile& output)
+{
+    struct stat status;
+    bool existed = stat(filename.c_str(), &status) == 0;
+    bool replace = !existed || S_ISREG(status.st_mode);
+    output.name = filename;
+    output.written = replace ? filename + ".tmp" + to_string(getpid()) + "_" + to_string(temp_files++) : filename;
+    output.fd = open(output.written.c_str(), O_WRONLY | O_CREAT | (replace ? O_EXCL : O_TRUNC), 0666);
+    if (output.fd >= 0 && existed && replace)
+    {
+        fchmod(output.fd, status.st_mode & 07777);
+    }
+    return output.fd >= 0;
+}
+
+/**
+ * Closes a file opened with open_output(), putting it in place if all of it
+ * was written and removing the temporary file otherwise
+ * Helper function for the BMP writers
+ * @param output the file
+ * @param ok     whether everything was written
+ * @return True if the file is in place and false otherwise
+ */
+bool close_output(OutputFile& output, bool ok)
+{
+    if (output.fd < 0)
+    {
+        return false;
+    }
+    ok = close(output.fd) == 0 && ok;
+    output.fd = -1;
+    if (output.written != output.name && (!ok || rename(output.written.c_str(), output.name.c_str()) != 0))
+    {
+        unlink(output.written.c_str());
+        ok = false;
+    }
+    return ok;
+}
+
+bool write_image(const string& filename, const Image& image)
+{
+    StageTimer timer("write_image");
+    if (image.empty())
+    {
+        return false;
+    }
+
+    int width_pixels = image.width();
+    int height_pixels = image.height();
+    int scanline_size = width_pixels * 3;
+    int padding_bytes = (4 - scanline_size % 4) % 4;
+
+    OutputFile file;
+    if (!open_output(filename, file))
+    {
+        return false;
+    }
+    int fd = file.fd;
+
+    unsigned char header[HEADERS_SIZE];
+    make_bmp_header(header, width_pixels, height_pixels);
+    static const unsigned char padding[3] = {0};
+
+    // Pixel Array (Left to right, bottom to top, with padding)
+    vector<struct iovec> iov(2 * WRITE_BATCH_ROWS + 1);
+    bool ok = true;
+    for (int first = 0; first < height_pixels && ok; first = first + WRITE_BATCH_ROWS)
+    {
+        int rows = min(WRITE_BATCH_ROWS, height_pixels - first);
+        int count = 0;
+        if (first == 0)
+        {
+            iov[count].iov_base = header;
+            iov[count].iov_len = HEADERS_SIZE;
+            count++;
+        }
+        for (int r = 0; r < rows; r++)
+        {
+            iov[count].iov_base = const_cast<uint8_t*>(image.row(height_pixels - 1 - (first + r)));
+            iov[count].iov_len = scanline_size;
+            count++;
+            if (padding_bytes > 0)
+            {
+                iov[count].iov_base = const_cast<unsigned char*>(padding);
+                iov[count].iov_len = padding_bytes;
+                count++;
+            }
+        }
+        ok = writev_fully(fd, iov.data(), count);
+    }
+
+    ok = close_output(file, ok);
+    timer.add_written(HEADERS_SIZE + (unsigned long long)(scanline_size + padding_bytes) * height_pixels);
+    timer.add_pixels((unsigned long long)width_pixels * height_pixels);
+    return ok;
+}
+
+bool decode_bmp(const uint8_t* data, size_t size, Image& image)
+{
+    StageTimer timer("decode_bmp");
+    image = Image();
+    BmpInfo info;
+    if (size < size_t(BMP_HEADER_BYTES) || !parse_bmp_header(data, int64_t(size), info))
+    {
+        return false;
+    }
+    Image result = Image::uninitialized(info.width, info.height);
+    for (int i = 0; i < info.height; i++)
+    {
+        // BMP files store pixels from bottom to top
+        const uint8_t* src = data + info.start + info.row_bytes * (info.height - 1 - i);
+        unpack_scanline(src, result.row(i), info.width, info.bytes_per_pixel);
+    }
+    timer.add_read(info.file_size);
+    timer.add_pixels((unsigned long long)info.width * info.height);
+    image = move(result);
+    return true;
+}
+
+bool encode_bmp(const ImageView& image, vector<uint8_t>& bmp)
+{
+    StageTimer timer("encode_bmp");
+    if (image.empty())
+    {
+        bmp.clear();
+        return false;
+    }
+    size_t scanline_size = size_t(image.width()) * Image::CHANNELS;
+    size_t row_bytes = scanline_size + (4 - scanline_size % 4) % 4;
+    bmp.assign(bmp_file_size(image.width(), image.height()), 0);
+    make_bmp_header(bmp.data(), image.width(), image.height());
+    for (int i = 0; i < image.height(); i++)
+    {
+        memcpy(bmp.data() + HEADERS_SIZE + row_bytes * (image.height() - 1 - i), image.row(i), scanline_size);
+    }
+    timer.add_written(bmp.size());
+    timer.add_pixels((unsigned long long)image.width() * image.height());
+    return true;
+}
+
+size_t bmp_file_size(int width, int height)
+{
+    size_t scanline_size = size_t(max(width, 0)) * Image::CHANNELS;
+    return HEADERS_SIZE + (scanline_size + (4 - scanline_size % 4) % 4) * size_t(max(height, 0));
+}
+
+//***************************************************************************************************//
+//                                    THREAD POOL                                                    //
+//***************************************************************************************************//
+
+/**
+ * A fixed set of worker threads that stay alive between images, scheduling
+ * by work stealing. Each thread has its own queue of tasks: it takes the
+ * newest of its own and, with none left, steals the oldest from another
+ * thread. A task may call parallel_for() itself, as a batch job does when it
+ * splits its image into bands; its items go on that thread's queue, where
+ * idle threads can steal them, and the thread runs queued tasks until they
+ * are done rather than block. The thread calling parallel_for() from outside
+ * works too, so a pool of size 1 has no threads of its own. Other threads
+ * calling from outside at the same time, such as the job server's
+ * connections, put their calls on a shared queue for the pool's threads to
+ * take, and wait for them.
+ */
+class ThreadPool
+{
+public:
+    // Waits a thread can nest while still running tasks of other calls
+    static const int MAX_NESTED_WAITS = 4;
+
+    explicit ThreadPool(int threads)
+    {
+        for (int w = 0; w < threads; w++)
+        {
+            queues_.emplace_back(new Queue);
+        }
+        for (int w = 1; w < threads; w++)
+        {
+            workers_.emplace_back(&ThreadPool::work, this, w);
+        }
+    }
+
+    ~ThreadPool()
+    {
+        {
+            lock_guard<mutex> guard(lock_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (size_t w = 0; w < workers_.size(); w++)
+        {
+            workers_[w].join();
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int size() const { return int(queues_.size()); }
+
+    /**
+     * Runs task(item, worker) for every item from 0 to count - 1 and waits
+     * for all of them. Items run in any order, on workers numbered 0 to
+     * size() - 1. A worker can run other items of the same call while an
+     * item it is running waits in a parallel_for() of its own, so an item
+     * must not keep anything indexed by worker across such a call.
+     * A call from a thread outside the pool while another outside thread
+     * is working in it goes on the shared queue, and the calling thread
+     * waits for the pool's threads to run it.
+     * @param count number of items
+     * @param task  the work for one item
+     * @return nothing
+     */
+    void parallel_for(int count, const function<void(int, int)>& task)
+    {
+        if (count <= 0)
+        {
+            return;
+        }
+        unique_lock<mutex> outside;
+        if (current_worker() < 0)
+        {
+            if (count == 1 || queues_.size() == 1)
+            {
+                run_inline(count, task);
+                return;
+            }
+            outside = unique_lock<mutex>(outside_lock_, try_to_lock);
+            if (!outside.owns_lock())
+            {
+                wait_for_pool(count, task);
+                return;
+            }
+            current_worker() = 0;
+        }
+
+        // Split the items in halves as they are taken, so a thief gets a big share
+        atomic<int> pending{count};
+        push(Task{&task, 0, count, &pending, current_job_metrics()});
+        help_until_done(pending);
+
+        if (outside.owns_lock())
+        {
+            current_worker() = -1;
+        }
+    }
+
+    /**
+     * Gets how much work the pool has done since it started
+     * @return the counts
+     */
+    SchedulerStats stats() const
+    {
+        SchedulerStats totals;
+        totals.busy_seconds = (busy_ns_ - waiting_ns_) / 1e9;
+        totals.tasks = tasks_;
+        totals.steals = steals_;
+        return totals;
+    }
+
+private:
+    // Items first to last - 1 of a call to parallel_for
+    struct Task
+    {
+        const function<void(int, int)>* body;
+        int first;
+        int last;
+        atomic<int>* pending;   // items of the call not yet finished
+        JobMetrics* job;        // the job measured on the thread that made the call, if any
+    };
+
+    struct Queue
+    {
+        mutex lock;
+        deque<Task> tasks;
+    };
+
+    // Number of the pool worker the calling thread is, or -1 outside the pool
+    static int& current_worker()
+    {
+        static thread_local int worker = -1;
+        return worker;
+    }
+
+    // Depth of tasks running on this thread, each one inside the last
+    static int& depth()
+    {
+        static thread_local int tasks = 0;
+        return tasks;
+    }
+
+    static long long now_ns()
+    {
+        return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void push(const Task& task)
+    {
+        {
+            Queue& queue = *queues_[current_worker()];
+            lock_guard<mutex> guard(queue.lock);
+            queue.tasks.push_back(task);
+        }
+        signal();
+    }
+
+    // Wakes every thread waiting for work, so none misses a task pushed or a call finished
+    void signal()
+    {
+        {
+            lock_guard<mutex> guard(lock_);
+            events_++;
+        }
+        wake_.notify_all();
+    }
+
+    /**
+     * Takes a task: the newest on this thread's queue, or else the oldest on
+     * another's, or else the oldest call waiting on the shared queue
+     * @param task receives the task
+     * @param only if not null, only a task of the call with this count of items pending
+     * @return True if there was one to take and false otherwise
+     */
+    bool take(Task& task, const atomic<int>* only = nullptr)
+    {
+        int self = current_worker();
+        for (int k = 0; k < size(); k++)
+        {
+            int victim = (self + k) % size();
+            Queue& queue = *queues_[victim];
+            lock_guard<mutex> guard(queue.lock);
+            for (size_t n = 0; n < queue.tasks.size(); n++)
+            {
+                // Own tasks newest first, stolen ones oldest first
+                size_t index = k == 0 ? queue.tasks.size() - 1 - n : n;
+                if (only == nullptr || queue.tasks[index].pending == only)
+                {
+                    task = queue.tasks[index];
+                    queue.tasks.erase(queue.tasks.begin() + index);
+                    steals_ += k == 0 ? 0 : 1;
+                    return true;
+                }
+            }
+        }
+        lock_guard<mutex> guard(incoming_.lock);
+        for (size_t index = 0; index < incoming_.tasks.size(); index++)
+        {
+            if (only == nullptr || incoming_.tasks[index].pending == only)
+            {
+                task = incoming_.tasks[index];
+                incoming_.tasks.erase(incoming_.tasks.begin() + index);
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void run(Task task)
+    {
+        // Leave the upper halves for other threads to steal, down to one item
+        while (task.last - task.first > 1)
+        {
+            int middle = task.first + (task.last - task.first) / 2;
+            push(Task{task.body, middle, task.last, task.pending, task.job});
+            task.last = middle;
+        }
+        long long begin = depth() == 0 ? now_ns() : 0;
+        depth()++;
+        JobMetrics* previous = current_job_metrics();
+        switch_job_metrics(task.job);
+        (*task.body)(task.first, current_worker());
+        switch_job_metrics(previous);
+        depth()--;
+        if (depth() == 0)
+        {
+            busy_ns_ += now_ns() - begin;
+        }
+        tasks_++;
+        if (--*task.pending == 0)
+        {
+            signal();
+        }
+    }
+
+    // Puts a call from a second outside thread on the shared queue and waits for the pool to run it
+    void wait_for_pool(int count, const function<void(int, int)>& task)
+    {
+        atomic<int> pending{count};
+        {
+            lock_guard<mutex> guard(incoming_.lock);
+            incoming_.tasks.push_back(Task{&task, 0, count, &pending, current_job_metrics()});
+        }
+        signal();
+        unique_lock<mutex> guard(lock_);
+        wake_.wait(guard, [&] { return pending == 0; });
+    }
+
+    // Runs every item of a call on the calling thread, timed as work like a pool task
+    void run_inline(int count, const function<void(int, int)>& task)
+    {
+        long long begin = depth() == 0 ? now_ns() : 0;
+        depth()++;
+        for (int item = 0; item < count; item++)
+        {
+            task(item, 0);
+        }
+        depth()--;
+        if (depth() == 0)
+        {
+            busy_ns_ += now_ns() - begin;
+        }
+        tasks_ += count;
+    }
+
+    // Runs tasks until every item of a call is done: any task while only a few
+    // waits are nested on this thread, and then only the call's own, so the
+    // stack stays shallow however many jobs there are
+    void help_until_done(atomic<int>& pending)
+    {
+        while (pending > 0)
+        {
+            unsigned long long seen = events();
+            Task task;
+            if (take(task, depth() < MAX_NESTED_WAITS ? nullptr : &pending))
+            {
+                run(task);
+                continue;
+            }
+            // Time a task spends waiting with nothing to do is not work
+            long long begin = now_ns();
+            unique_lock<mutex> guard(lock_);
+            wake_.wait(guard, [&] { return events_ != seen || pending == 0; });
+            if (depth() > 0)
+            {
+                waiting_ns_ += now_ns() - begin;
+            }
+        }
+    }
+
+    unsigned long long events()
+    {
+        lock_guard<mutex> guard(lock_);
+        return events_;
+    }
+
+    void work(int worker)
+    {
+        current_worker() = worker;
+        while (true)
+        {
+            unsigned long long seen = events();
+            Task task;
+            if (take(task))
+            {
+                run(task);
+                continue;
+            }
+            unique_lock<mutex> guard(lock_);
+            wake_.wait(guard, [&] { return stopping_ || events_ != seen; });
+            if (stopping_)
+            {
+                return;
+            }
+        }
+    }
+
+    vector<unique_ptr<Queue>> queues_;          // one per worker, the outside caller's first
+    Queue incoming_;                            // calls from outside threads other than worker 0
+    vector<thread> workers_;
+    mutex outside_lock_;                        // held by the outside thread working as worker 0
+    mutex lock_;
+    condition_variable wake_;
+    bool stopping_ = false;
+    unsigned long long events_ = 0;             // counts tasks pushed and calls finished
+    atomic<long long> busy_ns_{0};
+    atomic<long long> waiting_ns_{0};
+    atomic<long long> tasks_{0};
+    atomic<long long> steals_{0};
+};
+
+int default_thread_count()
+{
+    const char* wanted = getenv("IMAGEPROCESSOR_THREADS");
+    if (wanted != nullptr && atoi(wanted) > 0)
+    {
+        return atoi(wanted);
+    }
+    return max(1, int(thread::hardware_concurrency()));
+}
+
+unique_ptr<ThreadPool>& pool_instance()
+{
+    static unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+void set_thread_count(int threads)
+{
+    pool_instance().reset(new ThreadPool(max(threads, 1)));
+}
+
+/**
+ * Gets the pool images are processed with, starting it the first time
+ * @return the pool
+ */
+ThreadPool& thread_pool()
+{
+    static once_flag started;
+    call_once(started, [] {
+        if (!pool_instance())
+        {
+            set_thread_count(default_thread_count());
+        }
+    });
+    return *pool_instance();
+}
+
+int thread_count()
+{
+    return thread_pool().size();
+}
+
+SchedulerStats scheduler_stats()
+{
+    return thread_pool().stats();
+}
+
+// Smallest amount of pixel data worth handing to another thread
+const size_t MIN_TASK_BYTES = 64 << 10;
+
+/**
+ * Splits rows into bands and runs task(first, rows, worker) on the bands in
+ * parallel. Bands are a few per thread so uneven work evens out, never
+ * smaller than MIN_TASK_BYTES and never more than max_rows rows.
+ * @param rows      number of rows
+ * @param row_bytes bytes in a row
+ * @param max_rows  largest band wanted
+ * @param multiple  band sizes are rounded up to a multiple of this many rows
+ * @param task      the work for one band
+ * @return nothing
+ */
+void parallel_bands(int rows, size_t row_bytes, int max_rows, int multiple,
+                    const function<void(int, int, int)>& task)
+{
+    ThreadPool& pool = thread_pool();
+    int min_rows = int(min<size_t>(rows, max<size_t>(1, MIN_TASK_BYTES / max<size_t>(row_bytes, 1))));
+    int band_rows = max((rows + 4*pool.size() - 1) / (4*pool.size()), min_rows);
+    band_rows = (band_rows + multiple - 1) / multiple * multiple;
+    band_rows = max(1, min(band_rows, max_rows));
+    int bands = (rows + band_rows - 1) / band_rows;
+    pool.parallel_for(bands, [&](int band, int worker) {
+        int first = band * band_rows;
+        task(first, min(band_rows, rows - first), worker);
+    });
+}
+
+//***************************************************************************************************//
+//                                    IMAGE PROCESSES                                                //
+//***************************************************************************************************//
+
+bool is_point_process(int process)
+{
+    return process == 1 || process == 2 || process == 3 || (process >= 7 && process <= 10);
+}
+
+//***************************************************************************************************//
+//                                    FIXED POINT ARITHMETIC                                         //
+//***************************************************************************************************//
+
+const char* const FIXED_POINT_NAMES[] = {"off", "truncate", "nearest"};
+
+/**
+ * Reads the arithmetic named by the IMAGEPROCESSOR_FIXED_POINT environment
+ * variable (off, truncate or nearest)
+ * @return the arithmetic, or double if the variable is not set
+ */
+FixedPoint fixed_point_from_environment()
+{
+    const char* wanted = getenv("IMAGEPROCESSOR_FIXED_POINT");
+    for (int m = FIXED_POINT_OFF; wanted != nullptr && m <= FIXED_POINT_NEAREST; m++)
+    {
+        if (string(wanted) == FIXED_POINT_NAMES[m])
+        {
+            return FixedPoint(m);
+        }
+    }
+    return FIXED_POINT_OFF;
+}
+
+FixedPoint active_fixed_point = fixed_point_from_environment();
+
+FixedPoint set_fixed_point(FixedPoint mode)
+{
+    active_fixed_point = mode;
+    return active_fixed_point;
+}
+
+FixedPoint fixed_point()
+{
+    return active_fixed_point;
+}
+
+const char* fixed_point_name(FixedPoint mode)
+{
+    return FIXED_POINT_NAMES[mode];
+}
+
+/**
+ * Turns a fixed-point value into an integer
+ * @param value the value, with FIXED_POINT_BITS fraction bits
+ * @param mode  FIXED_POINT_TRUNCATE to truncate toward zero, as a conversion
+ *              from double does, or FIXED_POINT_NEAREST to round halves up
+ * @return the integer
+ */
+inline int64_t fixed_to_int(int64_t value, FixedPoint mode)
+{
+    if (mode == FIXED_POINT_NEAREST)
+    {
+        return (value + (int64_t(1) << (FIXED_POINT_BITS - 1))) >> FIXED_POINT_BITS;
+    }
+    return value / (int64_t(1) << FIXED_POINT_BITS);
+}
+
+/**
+ * Scales a channel value in double, as the processes always have: lighten
+ * (process 8) as int(255 - (255 - value)*scaling_factor), and darken and
+ * vignette as int(value*scaling_factor), kept to 8 bits
+ * @param process        8 for lighten, anything else for the other two
+ * @param value          the channel value
+ * @param scaling_factor the scaling factor
+ * @return the new channel value
+ */
+inline uint8_t double_scale(int process, int value, double scaling_factor)
+{
+    int newval = process == 8 ? int(255 - (255 - value)*scaling_factor) : int(value*scaling_factor);
+    return (uint8_t)newval;
+}
+
+/**
+ * Scales a channel value as double_scale() does, in fixed point
+ * @param process the process, as for double_scale()
+ * @param value   the channel value
+ * @param factor  the scaling factor, with FIXED_POINT_BITS fraction bits
+ * @param mode    how to round the product
+ * @return the new channel value
+ */
+inline uint8_t fixed_scale(int process, int value, int64_t factor, FixedPoint mode)
+{
+    int64_t product = process == 8 ? (int64_t(255) << FIXED_POINT_BITS) - (255 - value)*factor : value*factor;
+    return (uint8_t)fixed_to_int(product, mode);
+}
+
+/**
+ * Picks, from the fixed-point factors next to the nearest one, the factor
+ * that scales the most channel values to the bytes the double arithmetic gives
+ * @param process        the process, as for double_scale()
+ * @param scaling_factor the scaling factor
+ * @return the fixed-point factor
+ */
+int64_t search_fixed_factor(int process, double scaling_factor)
+{
+    int64_t nearest = llround(ldexp(scaling_factor, FIXED_POINT_BITS));
+    int64_t best = nearest;
+    int fewest = 257;
+    const int offsets[] = {0, -1, 1, -2, 2};
+    for (int k = 0; k < 5 && fewest > 0; k++)
+    {
+        int mismatches = 0;
+        for (int v = 0; v < 256; v++)
+        {
+            mismatches += fixed_scale(process, v, nearest + offsets[k], FIXED_POINT_TRUNCATE)
+                          != double_scale(process, v, scaling_factor);
+        }
+        if (mismatches < fewest)
+        {
+            fewest = mismatches;
+            best = nearest + offsets[k];
+        }
+    }
+    return best;
+}
+
+/**
+ * Works out the fixed-point factor to scale channel values by.
+ * Rounding to the nearest value uses the nearest fixed-point factor. Truncating
+ * needs the factor chosen more carefully, since a product just short of a whole
+ * number must stay short of it: int(v*f) only changes where f crosses a
+ * fraction n/v, so every fixed-point factor between the two fractions with
+ * denominators up to 255 on either side of f truncates exactly as f does, and
+ * with 16 fraction bits there is always one. A double product just short of a
+ * whole number can still round up to it, which only happens when f is within
+ * rounding of one of those fractions, so such factors, and those for lighten,
+ * whose subtraction rounds as well, are checked at every channel value.
+ * @param process        1, 8 or 9 (Clarendon uses 8 and 9)
+ * @param scaling_factor the scaling factor
+ * @param mode           FIXED_POINT_TRUNCATE or FIXED_POINT_NEAREST
+ * @return the factor, with FIXED_POINT_BITS fraction bits
+ */
+int64_t fixed_factor(int process, double scaling_factor, FixedPoint mode)
+{
+    if (mode == FIXED_POINT_NEAREST)
+    {
+        return llround(ldexp(scaling_factor, FIXED_POINT_BITS));
+    }
+    if (process == 8)
+    {
+        return search_fixed_factor(process, scaling_factor);
+    }
+
+    // Products with a negative factor truncate toward zero, the mirror image of a positive one
+    double x = fabs(scaling_factor);
+
+    // The fractions on either side of x with denominators up to 255 are the last
+    // convergent of its continued fraction to have such a denominator, and the
+    // semiconvergent after it
+    int64_t before_n = 0, before_d = 1, last_n = 1, last_d = 0;
+    double rest = x;
+    for (int k = 0; k < 64 && x < 1e9; k++)
+    {
+        double term = floor(rest);
+        if (term * last_d + before_d > 255)
+        {
+            break;
+        }
+        int64_t n = int64_t(term) * last_n + before_n;
+        int64_t d = int64_t(term) * last_d + before_d;
+        before_n = last_n;
+        before_d = last_d;
+        last_n = n;
+        last_d = d;
+        if (rest == term)
+        {
+            break;
+        }
+        rest = 1 / (rest - term);
+    }
+    int64_t steps = last_d == 0 ? 0 : (255 - before_d) / last_d;
+    int64_t next_n = steps * last_n + before_n;
+    int64_t next_d = steps * last_d + before_d;
+    bool below = last_n <= x * last_d;
+    int64_t low_n = below ? last_n : next_n, low_d = below ? last_d : next_d;
+    int64_t high_n = below ? next_n : last_n, high_d = below ? next_d : last_d;
+
+    // The bracket holds if its ends are neighbors with x clear of both. Within
+    // rounding of an end, the double products might not truncate the same way
+    // at every multiple of its denominator, so the factor is searched for instead.
+    double margin = 1e-9 * max(x, 1.0);
+    int64_t factor;
+    if (low_d > 0 && high_d > 0 && low_d + high_d > 255 && high_n * low_d - low_n * high_d == 1
+        && x * low_d - low_n > margin && high_n - x * high_d > margin)
+    {
+        double one = double(int64_t(1) << FIXED_POINT_BITS);
+        int64_t lowest = int64_t(ceil(low_n * one / low_d));
+        int64_t highest = int64_t(ceil(high_n * one / high_d)) - 1;
+        factor = min(max<int64_t>(llround(x * one), lowest), highest);
+    }
+    else
+    {
+        factor = search_fixed_factor(9, x);
+    }
+    return scaling_factor < 0 ? -factor : factor;
+}
+
+/**
+ * Counts a comparison of a channel value scaled both ways, keeping the first mismatch
+ * @param check          the comparison so far
+ * @param scaling_factor the scaling factor
+ * @param value          the channel value
+ * @param expected       the byte the double arithmetic gives
+ * @param actual         the byte the fixed-point arithmetic gives
+ * @return nothing
+ */
+void record_check(FixedPointCheck& check, double scaling_factor, int value, uint8_t expected, uint8_t actual)
+{
+    if (expected != actual && check.mismatches++ == 0)
+    {
+        check.factor = scaling_factor;
+        check.value = value;
+        check.expected = expected;
+        check.actual = actual;
+    }
+    check.values++;
+}
+
+FixedPointCheck check_fixed_point(FixedPoint mode, int process, double scaling_factor)
+{
+    FixedPointCheck check;
+    // Clarendon darkens with process 9's arithmetic and lightens with process 8's
+    int processes[2] = {process == 2 ? 9 : process, process == 2 ? 8 : 0};
+    for (int k = 0; k < 2 && processes[k] != 0; k++)
+    {
+        int64_t factor = fixed_factor(processes[k], scaling_factor, mode);
+        for (int v = 0; v < 256; v++)
+        {
+            uint8_t expected = double_scale(processes[k], v, scaling_factor);
+            uint8_t actual = mode == FIXED_POINT_OFF ? expected : fixed_scale(processes[k], v, factor, mode);
+            record_check(check, scaling_factor, v, expected, actual);
+        }
+    }
+    return check;
+}
+
+/**
+ * Vignette scaling factors for one image size. The factor depends only on
+ * how far a pixel is from the center, which is the same in all four
+ * quadrants, so only one quadrant is stored: entry (b, a) is for the pixels
+ * a columns and b rows out from the center, the left and top halves counting
+ * down to 0 and the right and bottom halves counting up from 0.
+ * The factors are computed exactly as process_1 always has, so scaling by
+ * them gives the same bytes. With fixed-point arithmetic on, the map holds
+ * fixed-point factors instead.
+ */
+class VignetteMap
+{
+public:
+    VignetteMap(int width, int height, FixedPoint mode)
+        : width_(width), height_(height), mode_(mode), columns_(width/2 + 1)
+    {
+        // A channel value times a fixed-point factor must fit in 32 bits, which only the
+        // corners of images over 250 times wider than tall break; those stay in double
+        double corner = (height - sqrt(pow(width/2.0, 2.0) + pow(height/2.0, 2.0)))/height;
+        fixed_ = mode != FIXED_POINT_OFF && corner > -128;
+        negative_ = corner < 0;
+        size_t count = size_t(height/2 + 1) * columns_;
+        if (!fixed_)
+        {
+            factors_.resize(count);
+        }
+        else
+        {
+            fixed_factors_.resize(count);
+        }
+        for (int b = 0; b <= height/2; b++)
+        {
+            int i = height/2 - b;
+            for (int a = 0; a <= width/2; a++)
+            {
+                int j = width/2 - a;
+                double distance = sqrt(pow((j - width/2.0),2.0) + pow((i - height/2.0),2.0));
+                double factor = (height - distance)/height;
+                if (!fixed_)
+                {
+                    factors_[size_t(b) * columns_ + a] = factor;
+                }
+                else
+                {
+                    fixed_factors_[size_t(b) * columns_ + a] = int32_t(fixed_factor(1, factor, mode));
+                }
+            }
+        }
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    FixedPoint mode() const { return mode_; }
+    bool fixed() const { return fixed_; }
+    bool negative() const { return negative_; }
+    size_t size_bytes() const { return factors_.size() * sizeof(double) + fixed_factors_.size() * sizeof(int32_t); }
+
+    /**
+     * Gets the factors for a row, by distance from the center column
+     * @param row index of the row from the top of the image
+     * @return width/2 + 1 factors
+     */
+    const double* row(int row) const
+    {
+        return &factors_[quadrant_row(row) * columns_];
+    }
+
+    /**
+     * Gets the fixed-point factors for a row, by distance from the center column
+     * @param row index of the row from the top of the image
+     * @return width/2 + 1 factors, with FIXED_POINT_BITS fraction bits
+     */
+    const int32_t* fixed_row(int row) const
+    {
+        return &fixed_factors_[quadrant_row(row) * columns_];
+    }
+
+private:
+    size_t quadrant_row(int row) const
+    {
+        return row < (height_ + 1)/2 ? height_/2 - row : row - (height_ + 1)/2;
+    }
+
+    int width_;
+    int height_;
+    FixedPoint mode_;       // the arithmetic asked for
+    bool fixed_;            // whether the factors are in fixed point
+    bool negative_;         // whether any factor is below zero (in the corners)
+    size_t columns_;
+    vector<double> factors_;            // when the arithmetic is double
+    vector<int32_t> fixed_factors_;     // otherwise
+};
+
+// Number of image sizes whose vignette factors are kept
+const size_t VIGNETTE_CACHE_ENTRIES = 8;
+
+/**
+ * Gets the vignette factors for an image size in the arithmetic in use,
+ * computing them only if the size is not among the ones used most recently
+ * @param width  width of the image
+ * @param height height of the image
+ * @return the factors
+ */
+shared_ptr<const VignetteMap> vignette_map(int width, int height)
+{
+    FixedPoint mode = fixed_point();
+    static mutex lock;
+    static vector<shared_ptr<const VignetteMap>> recent;    // most recently used first
+    {
+        lock_guard<mutex> guard(lock);
+        for (size_t k = 0; k < recent.size(); k++)
+        {
+            if (recent[k]->width() == width && recent[k]->height() == height && recent[k]->mode() == mode)
+            {
+                rotate(recent.begin(), recent.begin() + k, recent.begin() + k + 1);
+                return recent[0];
+            }
+        }
+    }
+    // Built outside the lock, so other sizes are not held up. A thread that
+    // built the same map meanwhile got there first, and its map is kept.
+    shared_ptr<const VignetteMap> map = make_shared<VignetteMap>(width, height, mode);
+    lock_guard<mutex> guard(lock);
+    for (size_t k = 0; k < recent.size(); k++)
+    {
+        if (recent[k]->width() == width && recent[k]->height() == height && recent[k]->mode() == mode)
+        {
+            rotate(recent.begin(), recent.begin() + k, recent.begin() + k + 1);
+            return recent[0];
+        }
+    }
+    recent.insert(recent.begin(), map);
+    if (recent.size() > VIGNETTE_CACHE_ENTRIES)
+    {
+        recent.pop_back();
+    }
+    return map;
+}
+
+// Scan line kernels for the per-pixel processes. Each maps a row of width
+// packed pixels from src to dst, and src and dst may be the same row.
+
+void vignette_row(const uint8_t* src, uint8_t* dst, int width, const double* factors)
+{
+    // The left half walks the factors toward the center, the right half back out
+    int left = (width + 1)/2;
+    for (int j = 0; j < width; j++)
+    {
+        double scaling_factor = j < left ? factors[width/2 - j] : factors[j - left];
+        for (int c = 0; c < Image::CHANNELS; c++)
+        {
+            int newval = src[3*j + c] * scaling_factor;
+            dst[3*j + c] = (uint8_t)newval;
+        }
+    }
+}
+
+// Vignette in fixed point, rounding as MODE says. NEGATIVE is false if no
+// factor is below zero, when truncating is a plain shift.
+template <FixedPoint MODE, bool NEGATIVE>
+void vignette_fixed_row(const uint8_t* src, uint8_t* dst, int width, const int32_t* factors)
+{
+    int left = (width + 1)/2;
+    for (int j = 0; j < width; j++)
+    {
+        int32_t scaling_factor = j < left ? factors[width/2 - j] : factors[j - left];
+        for (int c = 0; c < Image::CHANNELS; c++)
+        {
+            int32_t product = src[3*j + c] * scaling_factor;
+            if (MODE == FIXED_POINT_NEAREST)
+            {
+                dst[3*j + c] = (uint8_t)((product + (1 << (FIXED_POINT_BITS - 1))) >> FIXED_POINT_BITS);
+            }
+            else
+            {
+                dst[3*j + c] = (uint8_t)(NEGATIVE ? product / (1 << FIXED_POINT_BITS) : product >> FIXED_POINT_BITS);
+            }
+        }
+    }
+}
+
+FixedPointCheck check_fixed_point_vignette(FixedPoint mode, int width, int height)
+{
+    FixedPointCheck check;
+    VignetteMap reference(width, height, FIXED_POINT_OFF);
+    // The top half down to the center row covers every row of the quadrant
+    for (int i = 0; i <= height/2; i++)
+    {
+        const double* factors = reference.row(i);
+        for (int a = 0; a <= width/2; a++)
+        {
+            int64_t factor = mode == FIXED_POINT_OFF ? 0 : fixed_factor(1, factors[a], mode);
+            for (int v = 0; v < 256; v++)
+            {
+                uint8_t expected = double_scale(1, v, factors[a]);
+                uint8_t actual = mode == FIXED_POINT_OFF ? expected : fixed_scale(1, v, factor, mode);
+                record_check(check, factors[a], v, expected, actual);
+            }
+        }
+    }
+    return check;
+}
+
+void grayscale_row(const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int j = 0; j < width; j++)
+    {
+        // Every channel becomes the average of the three
+        uint8_t average = (src[3*j] + src[3*j + 1] + src[3*j + 2])/3;
+        dst[3*j + Image::BLUE] = average;
+        dst[3*j + Image::GREEN] = average;
+        dst[3*j + Image::RED] = average;
+    }
+}
+
+void high_contrast_row(const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int j = 0; j < width; j++)
+    {
+        // The average is an integer division, only then widened to a double
+        double average = (src[3*j] + src[3*j + 1] + src[3*j + 2])/3;
+        uint8_t newval = (average >= 255/2) ? 255 : 0;
+        dst[3*j + Image::BLUE] = newval;
+        dst[3*j + Image::GREEN] = newval;
+        dst[3*j + Image::RED] = newval;
+    }
+}
+
+void five_color_row(const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int j = 0; j < width; j++)
+    {
+        int redval = src[3*j + Image::RED];
+        int greenval = src[3*j + Image::GREEN];
+        int blueval = src[3*j + Image::BLUE];
+        int newred = 0;
+        int newgreen = 0;
+        int newblue = 0;
+
+        // The white case (sum >= 550) is always overridden by the checks
+        // below, so pixels are classified as black or their largest channel,
+        // preferring red, then green, then blue on ties
+        if (redval + greenval + blueval <= 150)
+        {
+        }
+        else if (redval >= greenval && redval >= blueval)
+        {
+            newred = 255;
+        }
+        else if (greenval >= blueval)
+        {
+            newgreen = 255;
+        }
+        else
+        {
+            newblue = 255;
+        }
+
+        dst[3*j + Image::RED] = newred;
+        dst[3*j + Image::GREEN] = newgreen;
+        dst[3*j + Image::BLUE] = newblue;
+    }
+}
+
+/**
+ * Adds a run of bytes to as many 32-bit sums, for adding up the columns of
+ * source rows when downscaling
+ * @param src   the bytes
+ * @param sums  the sums
+ * @param count number of bytes
+ * @return nothing
+ */
+void accumulate_row(const uint8_t* src, uint32_t* sums, size_t count)
+{
+    for (size_t k = 0; k < count; k++)
+    {
+        sums[k] = sums[k] + src[k];
+    }
+}
+
+/**
+ * Repeats each pixel of a row a whole number of times, for enlarging
+ * @param src   the row
+ * @param dst   the enlarged row, width * scale pixels
+ * @param width number of pixels in the row
+ * @param scale number of copies of each pixel
+ * @return nothing
+ */
+void replicate_row(const uint8_t* src, uint8_t* dst, int width, int scale)
+{
+    for (int j = 0; j < width; j++)
+    {
+        for (int k = 0; k < scale; k++)
+        {
+            memcpy(dst, src + 3*j, 3);
+            dst = dst + 3;
+        }
+    }
+}
+
+//***************************************************************************************************//
+//                                    SIMD KERNELS                                                   //
+//***************************************************************************************************//
+
+const char* const SIMD_LEVEL_NAMES[] = {"scalar", "sse4.1", "avx2", "avx512"};
+
+// Row kernels for one instruction set
+struct PixelKernels
+{
+    void (*grayscale)(const uint8_t* src, uint8_t* dst, int width);
+    void (*high_contrast)(const uint8_t* src, uint8_t* dst, int width);
+    void (*five_color)(const uint8_t* src, uint8_t* dst, int width);
+    void (*accumulate)(const uint8_t* src, uint32_t* sums, size_t count);
+    void (*replicate)(const uint8_t* src, uint8_t* dst, int width, int scale);
+};
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+
+// The vector kernels work on groups of 16 pixels (48 bytes) per 128-bit lane.
+// pshufb masks split a group into blue, green and red planes of 16 bytes, and
+// put planes back together, each output vector taking bytes from one input.
+struct PlaneMasks
+{
+    uint8_t split[3][3][16];    // [channel][input vector][byte]
+    uint8_t merge[3][3][16];    // [channel][output vector][byte]
+    uint8_t repeat[3][16];      // [output vector][byte], one plane into all channels
+
+    PlaneMasks()
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            for (int q = 0; q < 16; q++)
+            {
+                int byte = 16*k + q;
+                repeat[k][q] = byte / 3;
+                for (int c = 0; c < 3; c++)
+                {
+                    int source = 3*q + c;
+                    split[c][k][q] = source / 16 == k ? source % 16 : 0x80;
+                    merge[c][k][q] = byte % 3 == c ? byte / 3 : 0x80;
+                }
+            }
+        }
+    }
+};
+
+const PlaneMasks PLANE_MASKS;
+
+// pshufb masks for repeating each pixel of a row. Up to MASKED_SCALE copies,
+// output vector c of every period takes its bytes from a 16-byte window of
+// the source starting at byte start[c], and the windows move on by advance
+// bytes each period. With more copies a pixel fills at least 48 bytes and is
+// splatted across them, starting with blue or, for the last vector, with red.
+struct ReplicateMasks
+{
+    static const int MASKED_SCALE = 16;
+    struct Pattern
+    {
+        int period;
+        int advance;
+        int start[48];
+        uint8_t mask[48][16];
+    };
+    Pattern patterns[MASKED_SCALE + 1];
+    uint8_t splat[2][16];
+
+    ReplicateMasks()
+    {
+        for (int scale = 2; scale <= MASKED_SCALE; scale++)
+        {
+            Pattern& pattern = patterns[scale];
+            pattern.period = 1;
+            while (16*pattern.period % (3*scale) != 0)
+            {
+                pattern.period++;
+            }
+            pattern.advance = 16*pattern.period / scale;
+            for (int c = 0; c < pattern.period; c++)
+            {
+                pattern.start[c] = 3*(16*c / (3*scale));
+                for (int q = 0; q < 16; q++)
+                {
+                    int byte = 16*c + q;
+                    pattern.mask[c][q] = 3*(byte / (3*scale)) + byte % 3 - pattern.start[c];
+                }
+            }
+        }
+        for (int q = 0; q < 16; q++)
+        {
+            splat[0][q] = q % 3;
+            splat[1][q] = (q + 2) % 3;
+        }
+    }
+};
+
+const ReplicateMasks REPLICATE_MASKS;
+
+// The kernels pass vectors by value between inlined helpers, which is only
+// an ABI change for calls that never happen
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+/**
+ * The vector kernels, written once against an instruction set's traits: Isa::V
+ * holds Isa::LANES groups of 16 pixels, one per 128-bit lane.
+ * The sums of the three channels are exact in 16 bits, and dividing them by 3
+ * is done as a multiply-high by 0xAAAB and a shift, which is exact for every
+ * sum up to 765. Pixels past the last whole group go through the scalar kernel.
+ */
+template <class Isa>
+struct VectorKernels
+{
+    typedef typename Isa::V V;
+    static const int PIXELS = 16 * Isa::LANES;
+
+    static inline void split(const uint8_t* src, V& blue, V& green, V& red)
+    {
+        V in[3] = {Isa::load(src, 0), Isa::load(src, 1), Isa::load(src, 2)};
+        V* planes[3] = {&blue, &green, &red};
+        for (int c = 0; c < 3; c++)
+        {
+            *planes[c] = Isa::bit_or(Isa::bit_or(Isa::shuffle(in[0], Isa::mask(PLANE_MASKS.split[c][0])),
+                                                 Isa::shuffle(in[1], Isa::mask(PLANE_MASKS.split[c][1]))),
+                                     Isa::shuffle(in[2], Isa::mask(PLANE_MASKS.split[c][2])));
+        }
+    }
+
+    static inline void merge(uint8_t* dst, const V& blue, const V& green, const V& red)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            Isa::store(dst, k, Isa::bit_or(Isa::bit_or(Isa::shuffle(blue, Isa::mask(PLANE_MASKS.merge[0][k])),
+                                                       Isa::shuffle(green, Isa::mask(PLANE_MASKS.merge[1][k]))),
+                                           Isa::shuffle(red, Isa::mask(PLANE_MASKS.merge[2][k]))));
+        }
+    }
+
+    static inline void repeat(uint8_t* dst, const V& plane)
+    {
+        for (int k = 0; k < 3; k++)
+        {
+            Isa::store(dst, k, Isa::shuffle(plane, Isa::mask(PLANE_MASKS.repeat[k])));
+        }
+    }
+
+    // Sums of the channels of the low and high 8 pixels of each lane, in 16 bits
+    static inline void sums(const V& blue, const V& green, const V& red, V& low, V& high)
+    {
+        low = Isa::add16(Isa::add16(Isa::widen_low(blue), Isa::widen_low(green)), Isa::widen_low(red));
+        high = Isa::add16(Isa::add16(Isa::widen_high(blue), Isa::widen_high(green)), Isa::widen_high(red));
+    }
+
+    static inline void grayscale(const uint8_t* src, uint8_t* dst, int width)
+    {
+        int j = 0;
+        for (; j + PIXELS <= width; j = j + PIXELS)
+        {
+            V blue, green, red, low, high;
+            split(src + 3*j, blue, green, red);
+            sums(blue, green, red, low, high);
+            V third = Isa::set16(0xAAAB);
+            low = Isa::shift_right16(Isa::mulhi16(low, third), 1);
+            high = Isa::shift_right16(Isa::mulhi16(high, third), 1);
+            repeat(dst + 3*j, Isa::pack16(low, high));
+        }
+        grayscale_row(src + 3*j, dst + 3*j, width - j);
+    }
+
+    static inline void high_contrast(const uint8_t* src, uint8_t* dst, int width)
+    {
+        int j = 0;
+        for (; j + PIXELS <= width; j = j + PIXELS)
+        {
+            // An average of 127 or more is a sum of 381 or more
+            V blue, green, red, low, high;
+            split(src + 3*j, blue, green, red);
+            sums(blue, green, red, low, high);
+            V threshold = Isa::set16(381);
+            repeat(dst + 3*j, Isa::pack_masks16(Isa::at_least16(low, threshold), Isa::at_least16(high, threshold)));
+        }
+        high_contrast_row(src + 3*j, dst + 3*j, width - j);
+    }
+
+    static inline void five_color(const uint8_t* src, uint8_t* dst, int width)
+    {
+        int j = 0;
+        for (; j + PIXELS <= width; j = j + PIXELS)
+        {
+            V blue, green, red, low, high;
+            split(src + 3*j, blue, green, red);
+            sums(blue, green, red, low, high);
+            V threshold = Isa::set16(151);
+            V colored = Isa::pack_masks16(Isa::at_least16(low, threshold), Isa::at_least16(high, threshold));
+            V red_max = Isa::bit_and(Isa::at_least8(red, green), Isa::at_least8(red, blue));
+            V green_max = Isa::at_least8(green, blue);
+            V is_red = Isa::bit_and(colored, red_max);
+            V is_green = Isa::and_not(red_max, Isa::bit_and(colored, green_max));
+            V is_blue = Isa::and_not(red_max, Isa::and_not(green_max, colored));
+            merge(dst + 3*j, is_blue, is_green, is_red);
+        }
+        five_color_row(src + 3*j, dst + 3*j, width - j);
+    }
+
+    static inline void accumulate(const uint8_t* src, uint32_t* sums, size_t count)
+    {
+        size_t k = 0;
+        for (; k + Isa::WIDEN_BYTES <= count; k = k + Isa::WIDEN_BYTES)
+        {
+            Isa::add_widened(src + k, sums + k);
+        }
+        accumulate_row(src + k, sums + k, count - k);
+    }
+};
+
+#pragma GCC push_options
+#pragma GCC target("sse4.1")
+struct Sse41
+{
+    typedef __m128i V;
+    static const int LANES = 1;
+    static V load(const uint8_t* p, int k) { return _mm_loadu_si128((const __m128i*)(p + 16*k)); }
+    static void store(uint8_t* p, int k, V v) { _mm_storeu_si128((__m128i*)(p + 16*k), v); }
+    static V mask(const uint8_t m[16]) { return _mm_loadu_si128((const __m128i*)m); }
+    static V shuffle(V a, V m) { return _mm_shuffle_epi8(a, m); }
+    static V bit_or(V a, V b) { return _mm_or_si128(a, b); }
+    static V bit_and(V a, V b) { return _mm_and_si128(a, b); }
+    static V and_not(V a, V b) { return _mm_andnot_si128(a, b); }
+    static V widen_low(V a) { return _mm_unpacklo_epi8(a, _mm_setzero_si128()); }
+    static V widen_high(V a) { return _mm_unpackhi_epi8(a, _mm_setzero_si128()); }
+    static V add16(V a, V b) { return _mm_add_epi16(a, b); }
+    static V set16(int v) { return _mm_set1_epi16(short(v)); }
+    static V mulhi16(V a, V b) { return _mm_mulhi_epu16(a, b); }
+    static V shift_right16(V a, int n) { return _mm_srli_epi16(a, n); }
+    static V pack16(V a, V b) { return _mm_packus_epi16(a, b); }
+    static V pack_masks16(V a, V b) { return _mm_packs_epi16(a, b); }
+    static V at_least16(V a, V b) { return _mm_cmpeq_epi16(_mm_max_epu16(a, b), a); }
+    static V at_least8(V a, V b) { return _mm_cmpeq_epi8(_mm_max_epu8(a, b), a); }
+
+    // Adds WIDEN_BYTES bytes to as many 32-bit sums
+    static const int WIDEN_BYTES = 16;
+    static void add_widened(const uint8_t* p, uint32_t* sums)
+    {
+        V v = _mm_loadu_si128((const __m128i*)p);
+        for (int q = 0; q < 4; q++, v = _mm_srli_si128(v, 4))
+        {
+            __m128i* s = (__m128i*)(sums + 4*q);
+            _mm_storeu_si128(s, _mm_add_epi32(_mm_loadu_si128(s), _mm_cvtepu8_epi32(v)));
+        }
+    }
+};
+
+__attribute__((flatten)) void grayscale_sse41(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Sse41>::grayscale(src, dst, width);
+}
+
+__attribute__((flatten)) void high_contrast_sse41(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Sse41>::high_contrast(src, dst, width);
+}
+
+__attribute__((flatten)) void five_color_sse41(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Sse41>::five_color(src, dst, width);
+}
+
+__attribute__((flatten)) void accumulate_sse41(const uint8_t* src, uint32_t* sums, size_t count)
+{
+    VectorKernels<Sse41>::accumulate(src, sums, count);
+}
+
+// Each 16 bytes of a replicated row come from one window of the source, so
+// this kernel works on 128-bit vectors at every instruction set. It does one
+// store per 16 bytes of output, which is what bounds it.
+void replicate_sse41(const uint8_t* src, uint8_t* dst, int width, int scale)
+{
+    size_t row_bytes = size_t(width) * 3;
+    if (scale == 1)
+    {
+        memcpy(dst, src, row_bytes);
+        return;
+    }
+    if (scale > ReplicateMasks::MASKED_SCALE)
+    {
+        // Steps of 15 bytes keep the channels in place, and the last vector ends the pixel's copies
+        __m128i first = _mm_loadu_si128((const __m128i*)REPLICATE_MASKS.splat[0]);
+        __m128i last = _mm_loadu_si128((const __m128i*)REPLICATE_MASKS.splat[1]);
+        size_t block = size_t(scale) * 3;
+        for (int j = 0; j < width; j++)
+        {
+            uint32_t bytes = 0;
+            memcpy(&bytes, src + 3*j, 3);
+            __m128i pixel = _mm_cvtsi32_si128(int(bytes));
+            __m128i copies = _mm_shuffle_epi8(pixel, first);
+            uint8_t* out = dst + block*j;
+            for (size_t k = 0; k + 16 < block; k = k + 15)
+            {
+                _mm_storeu_si128((__m128i*)(out + k), copies);
+            }
+            _mm_storeu_si128((__m128i*)(out + block - 16), _mm_shuffle_epi8(pixel, last));
+        }
+        return;
+    }
+
+    // Whole vectors while their windows stay inside the row, then the pixels left
+    const ReplicateMasks::Pattern& pattern = REPLICATE_MASKS.patterns[scale];
+    size_t out_bytes = row_bytes * scale;
+    size_t window = 0;
+    size_t o = 0;
+    for (int c = 0; o + 16 <= out_bytes && window + pattern.start[c] + 16 <= row_bytes; o = o + 16)
+    {
+        __m128i in = _mm_loadu_si128((const __m128i*)(src + window + pattern.start[c]));
+        _mm_storeu_si128((__m128i*)(dst + o), _mm_shuffle_epi8(in, _mm_loadu_si128((const __m128i*)pattern.mask[c])));
+        c++;
+        if (c == pattern.period)
+        {
+            c = 0;
+            window = window + pattern.advance;
+        }
+    }
+    int j = int(o / (3*size_t(scale)));
+    replicate_row(src + 3*j, dst + 3*size_t(j)*scale, width - j, scale);
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx2")
+struct Avx2
+{
+    // Lane L holds the group of 16 pixels starting at byte 48 * L
+    typedef __m256i V;
+    static const int LANES = 2;
+    static V load(const uint8_t* p, int k)
+    {
+        return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i*)(p + 16*k))),
+                                       _mm_loadu_si128((const __m128i*)(p + 48 + 16*k)), 1);
+    }
+    static void store(uint8_t* p, int k, V v)
+    {
+        _mm_storeu_si128((__m128i*)(p + 16*k), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i*)(p + 48 + 16*k), _mm256_extracti128_si256(v, 1));
+    }
+    static V mask(const uint8_t m[16]) { return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i*)m)); }
+    static V shuffle(V a, V m) { return _mm256_shuffle_epi8(a, m); }
+    static V bit_or(V a, V b) { return _mm256_or_si256(a, b); }
+    static V bit_and(V a, V b) { return _mm256_and_si256(a, b); }
+    static V and_not(V a, V b) { return _mm256_andnot_si256(a, b); }
+    static V widen_low(V a) { return _mm256_unpacklo_epi8(a, _mm256_setzero_si256()); }
+    static V widen_high(V a) { return _mm256_unpackhi_epi8(a, _mm256_setzero_si256()); }
+    static V add16(V a, V b) { return _mm256_add_epi16(a, b); }
+    static V set16(int v) { return _mm256_set1_epi16(short(v)); }
+    static V mulhi16(V a, V b) { return _mm256_mulhi_epu16(a, b); }
+    static V shift_right16(V a, int n) { return _mm256_srli_epi16(a, n); }
+    static V pack16(V a, V b) { return _mm256_packus_epi16(a, b); }
+    static V pack_masks16(V a, V b) { return _mm256_packs_epi16(a, b); }
+    static V at_least16(V a, V b) { return _mm256_cmpeq_epi16(_mm256_max_epu16(a, b), a); }
+    static V at_least8(V a, V b) { return _mm256_cmpeq_epi8(_mm256_max_epu8(a, b), a); }
+
+    // Adds WIDEN_BYTES bytes to as many 32-bit sums
+    static const int WIDEN_BYTES = 32;
+    static void add_widened(const uint8_t* p, uint32_t* sums)
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            __m256i* s = (__m256i*)(sums + 8*q);
+            V v = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)(p + 8*q)));
+            _mm256_storeu_si256(s, _mm256_add_epi32(_mm256_loadu_si256(s), v));
+        }
+    }
+};
+
+__attribute__((flatten)) void grayscale_avx2(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx2>::grayscale(src, dst, width);
+}
+
+__attribute__((flatten)) void high_contrast_avx2(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx2>::high_contrast(src, dst, width);
+}
+
+__attribute__((flatten)) void five_color_avx2(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx2>::five_color(src, dst, width);
+}
+
+__attribute__((flatten)) void accumulate_avx2(const uint8_t* src, uint32_t* sums, size_t count)
+{
+    VectorKernels<Avx2>::accumulate(src, sums, count);
+}
+#pragma GCC pop_options
+
+#pragma GCC push_options
+#pragma GCC target("avx512f,avx512bw")
+struct Avx512
+{
+    // Lane L holds the group of 16 pixels starting at byte 48 * L
+    typedef __m512i V;
+    static const int LANES = 4;
+    static V load(const uint8_t* p, int k)
+    {
+        V v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i*)(p + 16*k)));
+        v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 48 + 16*k)), 1);
+        v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 96 + 16*k)), 2);
+        return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i*)(p + 144 + 16*k)), 3);
+    }
+    static void store(uint8_t* p, int k, V v)
+    {
+        _mm_storeu_si128((__m128i*)(p + 16*k), _mm512_maskz_extracti32x4_epi32(0xF, v, 0));
+        _mm_storeu_si128((__m128i*)(p + 48 + 16*k), _mm512_maskz_extracti32x4_epi32(0xF, v, 1));
+        _mm_storeu_si128((__m128i*)(p + 96 + 16*k), _mm512_maskz_extracti32x4_epi32(0xF, v, 2));
+        _mm_storeu_si128((__m128i*)(p + 144 + 16*k), _mm512_maskz_extracti32x4_epi32(0xF, v, 3));
+    }
+    static V mask(const uint8_t m[16]) { return _mm512_maskz_broadcast_i32x4(0xFFFF, _mm_loadu_si128((const __m128i*)m)); }
+    static V shuffle(V a, V m) { return _mm512_shuffle_epi8(a, m); }
+    static V bit_or(V a, V b) { return _mm512_or_si512(a, b); }
+    static V bit_and(V a, V b) { return _mm512_and_si512(a, b); }
+    static V and_not(V a, V b) { return _mm512_maskz_andnot_epi64(0xFF, a, b); }
+    static V widen_low(V a) { return _mm512_unpacklo_epi8(a, _mm512_setzero_si512()); }
+    static V widen_high(V a) { return _mm512_unpackhi_epi8(a, _mm512_setzero_si512()); }
+    static V add16(V a, V b) { return _mm512_add_epi16(a, b); }
+    static V set16(int v) { return _mm512_set1_epi16(short(v)); }
+    static V mulhi16(V a, V b) { return _mm512_mulhi_epu16(a, b); }
+    static V shift_right16(V a, int n) { return _mm512_srli_epi16(a, n); }
+    static V pack16(V a, V b) { return _mm512_packus_epi16(a, b); }
+    static V pack_masks16(V a, V b) { return _mm512_packs_epi16(a, b); }
+    static V at_least16(V a, V b) { return _mm512_movm_epi16(_mm512_cmpge_epu16_mask(a, b)); }
+    static V at_least8(V a, V b) { return _mm512_movm_epi8(_mm512_cmpge_epu8_mask(a, b)); }
+
+    // Adds WIDEN_BYTES bytes to as many 32-bit sums
+    static const int WIDEN_BYTES = 64;
+    static void add_widened(const uint8_t* p, uint32_t* sums)
+    {
+        for (int q = 0; q < 4; q++)
+        {
+            V v = _mm512_maskz_cvtepu8_epi32(0xFFFF, _mm_loadu_si128((const __m128i*)(p + 16*q)));
+            _mm512_storeu_si512(sums + 16*q, _mm512_add_epi32(_mm512_loadu_si512(sums + 16*q), v));
+        }
+    }
+};
+
+__attribute__((flatten)) void grayscale_avx512(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx512>::grayscale(src, dst, width);
+}
+
+__attribute__((flatten)) void high_contrast_avx512(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx512>::high_contrast(src, dst, width);
+}
+
+__attribute__((flatten)) void five_color_avx512(const uint8_t* src, uint8_t* dst, int width)
+{
+    VectorKernels<Avx512>::five_color(src, dst, width);
+}
+
+__attribute__((flatten)) void accumulate_avx512(const uint8_t* src, uint32_t* sums, size_t count)
+{
+    VectorKernels<Avx512>::accumulate(src, sums, count);
+}
+#pragma GCC pop_options
+
+#pragma GCC diagnostic pop
+
+/**
+ * Finds the fastest instruction set the CPU running the program supports
+ * @return the instruction set
+ */
+SimdLevel detect_simd_level()
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw"))
+    {
+        return SIMD_AVX512;
+    }
+    if (__builtin_cpu_supports("avx2"))
+    {
+        return SIMD_AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1"))
+    {
+        return SIMD_SSE41;
+    }
+    return SIMD_SCALAR;
+}
+#else
+SimdLevel detect_simd_level()
+{
+    return SIMD_SCALAR;
+}
+#endif
+
+/**
+ * Gets the row kernels for an instruction set
+ * @param level the instruction set (must be supported by the CPU)
+ * @return the kernels
+ */
+PixelKernels kernels_for(SimdLevel level)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    switch (level)
+    {
+        case SIMD_AVX512:
+            return PixelKernels{grayscale_avx512, high_contrast_avx512, five_color_avx512, accumulate_avx512,
+                                replicate_sse41};
+        case SIMD_AVX2:
+            return PixelKernels{grayscale_avx2, high_contrast_avx2, five_color_avx2, accumulate_avx2, replicate_sse41};
+        case SIMD_SSE41:
+            return PixelKernels{grayscale_sse41, high_contrast_sse41, five_color_sse41, accumulate_sse41,
+                                replicate_sse41};
+        default: break;
+    }
+#endif
+    (void)level;
+    return PixelKernels{grayscale_row, high_contrast_row, five_color_row, accumulate_row, replicate_row};
+}
+
+/**
+ * Reads the instruction set named by the IMAGEPROCESSOR_SIMD environment
+ * variable (scalar, sse4.1, avx2 or avx512)
+ * @return the instruction set, or the fastest one if the variable is not set
+ */
+SimdLevel simd_level_from_environment()
+{
+    const char* wanted = getenv("IMAGEPROCESSOR_SIMD");
+    for (int l = SIMD_SCALAR; wanted != nullptr && l <= SIMD_AVX512; l++)
+    {
+        if (string(wanted) == SIMD_LEVEL_NAMES[l])
+        {
+            return SimdLevel(l);
+        }
+    }
+    return SIMD_AVX512;
+}
+
+// The kernels in use, chosen before main() runs so threads never race to pick them
+SimdLevel active_level = min(simd_level_from_environment(), detect_simd_level());
+PixelKernels active_kernels = kernels_for(active_level);
+
+SimdLevel set_simd_level(SimdLevel level)
+{
+    active_level = min(level, detect_simd_level());
+    active_kernels = kernels_for(active_level);
+    return active_level;
+}
+
+SimdLevel simd_level()
+{
+    return active_level;
+}
+
+const char* simd_level_name(SimdLevel level)
+{
+    return SIMD_LEVEL_NAMES[level];
+}
+
+/**
+ * Gets the row kernels in use: the best the CPU supports, unless the
+ * IMAGEPROCESSOR_SIMD environment variable or set_simd_level() asks for less
+ * @return the kernels
+ */
+const PixelKernels& pixel_kernels()
+{
+    return active_kernels;
+}
+
+// A channel value mapping: entry v is what a channel of value v becomes
+typedef array<uint8_t, 256> ToneTable;
+
+/**
+ * Makes the table that leaves every channel value as it is
+ * @return the table
+ */
+ToneTable identity_table()
+{
+    ToneTable table;
+    for (int v = 0; v < 256; v++)
+    {
+        table[v] = v;
+    }
+    return table;
+}
+
+/**
+ * Makes the table for lighten (process 8) or darken (process 9). Entries use
+ * the same double arithmetic and truncation as the processes always have, so
+ * looking a channel up gives exactly the byte the arithmetic would, or the
+ * fixed-point arithmetic if that is in use.
+ * @param process        8 or 9
+ * @param scaling_factor the scaling factor of the process
+ * @return the table
+ */
+ToneTable tone_table(int process, double scaling_factor)
+{
+    FixedPoint mode = fixed_point();
+    int64_t factor = mode == FIXED_POINT_OFF ? 0 : fixed_factor(process, scaling_factor, mode);
+    ToneTable table;
+    for (int v = 0; v < 256; v++)
+    {
+        table[v] = mode == FIXED_POINT_OFF ? double_scale(process, v, scaling_factor)
+                                           : fixed_scale(process, v, factor, mode);
+    }
+    return table;
+}
+
+/**
+ * Composes two tables into one that has the effect of applying both in turn
+ * @param first the table applied first
+ * @param then  the table applied to its result
+ * @return the combined table
+ */
+ToneTable compose(const ToneTable& first, const ToneTable& then)
+{
+    ToneTable table;
+    for (int v = 0; v < 256; v++)
+    {
+        table[v] = then[first[v]];
+    }
+    return table;
+}
+
+/**
+ * Maps every channel of a scan line through a table
+ * @param table the table
+ * @param src   the input row
+ * @param dst   the output row (may be the input row)
+ * @param width number of pixels in the row
+ * @return nothing
+ */
+void table_row(const ToneTable& table, const uint8_t* src, uint8_t* dst, int width)
+{
+    const uint8_t* lookup = table.data();
+    int bytes = width * Image::CHANNELS;
+    int j = 0;
+    for (; j + 4 <= bytes; j = j + 4)
+    {
+        uint8_t a = lookup[src[j]];
+        uint8_t b = lookup[src[j + 1]];
+        uint8_t c = lookup[src[j + 2]];
+        uint8_t d = lookup[src[j + 3]];
+        dst[j] = a;
+        dst[j + 1] = b;
+        dst[j + 2] = c;
+        dst[j + 3] = d;
+    }
+    for (; j < bytes; j++)
+    {
+        dst[j] = lookup[src[j]];
+    }
+}
+
+/**
+ * Clarendon with its channel mapping for each brightness class in a table:
+ * tables[0] for dark pixels (average below 90), tables[1] for the rest and
+ * tables[2] for bright pixels (average 170 or more). The average is the
+ * integer division the process has always used.
+ * @param tables the three tables
+ * @param src    the input row
+ * @param dst    the output row (may be the input row)
+ * @param width  number of pixels in the row
+ * @return nothing
+ */
+void clarendon_row(const ToneTable tables[3], const uint8_t* src, uint8_t* dst, int width)
+{
+    for (int j = 0; j < width; j++)
+    {
+        int average = (src[3*j] + src[3*j + 1] + src[3*j + 2])/3;
+        const uint8_t* lookup = tables[(average >= 90) + (average >= 170)].data();
+        uint8_t blue = lookup[src[3*j]];
+        uint8_t green = lookup[src[3*j + 1]];
+        uint8_t red = lookup[src[3*j + 2]];
+        dst[3*j] = blue;
+        dst[3*j + 1] = green;
+        dst[3*j + 2] = red;
+    }
+}
+
+/**
+ * A run of per-pixel processes compiled for one pass over each scan line.
+ * Lighten and darken depend on nothing but a channel's value, so runs of them
+ * are compiled into one 256-entry table, and a table that follows Clarendon
+ * or grayscale is folded into that stage's own tables.
+ */
+class PointProgram
+{
+public:
+    PointProgram()
+    {
+    }
+
+    /**
+     * Compiles a run of per-pixel processes for an image size. The vignette
+     * factors, if needed, are looked up here once for the whole image.
+     * @param ops    the processes, in order (all per-pixel)
+     * @param width  width of the image the program runs on
+     * @param height height of the image
+     */
+    PointProgram(const vector<Operation>& ops, int width, int height)
+    {
+        for (size_t k = 0; k < ops.size(); k++)
+        {
+            const Operation& op = ops[k];
+            if (op.process == 8 || op.process == 9)
+            {
+                ToneTable table = tone_table(op.process, op.scaling_factor);
+                Stage* last = stages_.empty() ? nullptr : &stages_.back();
+                if (last != nullptr && (last->process == 0 || last->process == 3))
+                {
+                    last->tables[0] = compose(last->tables[0], table);
+                    last->has_table = true;
+                }
+                else if (last != nullptr && last->process == 2)
+                {
+                    for (int t = 0; t < 3; t++)
+                    {
+                        last->tables[t] = compose(last->tables[t], table);
+                    }
+                }
+                else
+                {
+                    stages_.push_back(Stage{0, {table}, true});
+                }
+            }
+            else if (op.process == 2)
+            {
+                // Dark pixels are darkened and bright ones lightened by the same factor
+                stages_.push_back(Stage{2, {tone_table(9, op.scaling_factor), identity_table(),
+                                            tone_table(8, op.scaling_factor)}, true});
+            }
+            else
+            {
+                stages_.push_back(Stage{op.process, {identity_table()}, false});
+            }
+            if (op.process == 1 && vignette_ == nullptr)
+            {
+                vignette_ = vignette_map(width, height);
+            }
+        }
+    }
+
+    bool empty() const { return stages_.empty(); }
+
+    /**
+     * Runs the program on one scan line, the first stage from src to dst and
+     * the rest in place, so the row stays in cache
+     * @param src    the input row
+     * @param dst    the output row (may be the input row)
+     * @param width  number of pixels in the row, the width the program was compiled for
+     * @param row    index of the row from the top of the image
+     * @return nothing
+     */
+    void run_row(const uint8_t* src, uint8_t* dst, int width, int row) const
+    {
+        if (stages_.empty() && dst != src)
+        {
+            memcpy(dst, src, size_t(width) * Image::CHANNELS);
+        }
+        const PixelKernels& kernels = pixel_kernels();
+        for (size_t k = 0; k < stages_.size(); k++)
+        {
+            const Stage& stage = stages_[k];
+            const uint8_t* in = k == 0 ? src : dst;
+            switch (stage.process)
+            {
+                case 0: table_row(stage.tables[0], in, dst, width); break;
+                case 1: vignette(in, dst, width, row); break;
+                case 2: clarendon_row(stage.tables, in, dst, width); break;
+                case 3: kernels.grayscale(in, dst, width); break;
+                case 7: kernels.high_contrast(in, dst, width); break;
+                case 10: kernels.five_color(in, dst, width); break;
+            }
+            // Lighten and darken after grayscale are applied to its result
+            if (stage.process == 3 && stage.has_table)
+            {
+                table_row(stage.tables[0], dst, dst, width);
+            }
+        }
+    }
+
+private:
+    void vignette(const uint8_t* src, uint8_t* dst, int width, int row) const
+    {
+        const VignetteMap* map = vignette_.get();
+        if (!map->fixed())
+        {
+            vignette_row(src, dst, width, map->row(row));
+        }
+        else if (map->mode() == FIXED_POINT_NEAREST)
+        {
+            vignette_fixed_row<FIXED_POINT_NEAREST, true>(src, dst, width, map->fixed_row(row));
+        }
+        else if (map->negative())
+        {
+            vignette_fixed_row<FIXED_POINT_TRUNCATE, true>(src, dst, width, map->fixed_row(row));
+        }
+        else
+        {
+            vignette_fixed_row<FIXED_POINT_TRUNCATE, false>(src, dst, width, map->fixed_row(row));
+        }
+    }
+
+    struct Stage
+    {
+        int process;            // 1, 2, 3, 7 or 10, or 0 for a table lookup on every channel
+        ToneTable tables[3];    // process 0 and 3 use tables[0], Clarendon uses all three
+        bool has_table;         // false for grayscale with nothing folded into it
+    };
+
+    vector<Stage> stages_;
+    shared_ptr<const VignetteMap> vignette_;    // held for the whole image, if a stage is vignette
+};
+
+/**
+ * Names a run of processes for instrumentation: "process_N", or several
+ * joined by "+" when they run fused, as in "process_3+process_9"
+ * @param ops the processes
+ * @return the name
+ */
+string stage_name(const vector<Operation>& ops)
+{
+    string name;
+    for (size_t k = 0; k < ops.size(); k++)
+    {
+        name += (k == 0 ? "process_" : "+process_") + to_string(ops[k].process);
+    }
+    return name;
+}
+
+/**
+ * Applies a list of per-pixel processes to a whole image in a single pass,
+ * writing rows of packed pixels in memory the caller owns
+ * @param image  the input image
+ * @param ops    the processes, in order
+ * @param output first byte of the top row of the result, which has the size
+ *               of the input (may be the first byte of the input itself)
+ * @param stride distance in bytes from one row of the result to the next one down
+ * @return nothing
+ */
+void apply_point_ops(const ImageView& image, const vector<Operation>& ops, uint8_t* output, ptrdiff_t stride)
+{
+    StageTimer timer("process");
+    if (timer.active())
+    {
+        timer.rename(stage_name(ops));
+        timer.add_pixels((unsigned long long)image.width() * image.height());
+    }
+    PointProgram program(ops, image.width(), image.height());
+    parallel_bands(image.height(), size_t(image.width()) * Image::CHANNELS, image.height(), 1,
+                   [&](int first, int rows, int) {
+        for (int i = first; i < first + rows; i++)
+        {
+            program.run_row(image.row(i), output + stride * i, image.width(), i);
+        }
+    });
+}
+
+/**
+ * Applies a list of per-pixel processes to a whole image in a single pass
+ * @param image  the input image
+ * @param ops    the processes, in order
+ * @param output receives the result, reusing its buffer if big enough
+ *               (may be the image viewed as the input)
+ * @return nothing
+ */
+void apply_point_ops(const ImageView& image, const vector<Operation>& ops, Image& output)
+{
+    output.resize_uninitialized(image.width(), image.height());
+    apply_point_ops(image, ops, output.data(), output.stride());
+}
+
+/**
+ * Applies a list of per-pixel processes to a whole image in a single pass
+ * @param image the input image
+ * @param ops   the processes, in order
+ * @return the new image
+ */
+Image apply_point_ops(const ImageView& image, const vector<Operation>& ops)
+{
+    Image newimage;
+    apply_point_ops(image, ops, newimage);
+    return newimage;
+}
+
+/**
+ * Applies a list of per-pixel processes to an image, overwriting it
+ * @param image the image
+ * @param ops   the processes, in order
+ * @return nothing
+ */
+void apply_point_ops_in_place(Image& image, const vector<Operation>& ops)
+{
+    if (!ops.empty())
+    {
+        apply_point_ops(image.view(), ops, image);
+    }
+}
+
+/**
+ * Works out how many quarter turns clockwise process_5 makes.
+ * Only remainders of 0, 90 and 180 degrees are recognized; everything else,
+ * negative remainders included, turns three times as it always has.
+ * @param number number of 90 degree rotations asked for
+ * @return 0, 1, 2 or 3
+ */
+int quarter_turns(int number)
+{
+    int angle = int(number * 90);
+    if (angle % 360 == 0)
+    {
+        return 0;
+    }
+    else if (angle % 360 == 90)
+    {
+        return 1;
+    }
+    else if (angle % 360 == 180)
+    {
+        return 2;
+    }
+    return 3;
+}
+
+// Rotations by a quarter turn copy square tiles of this many pixels a side,
+// so the rows of a tile in the source and in the output stay in cache
+const int ROTATE_TILE = 32;
+
+/**
+ * Copies a row of pixels in reverse order
+ * @param src   the input row
+ * @param dst   the output row (not the input row)
+ * @param width number of pixels in the row
+ * @return nothing
+ */
+void reverse_pixels(const uint8_t* src, uint8_t* dst, int width)
+{
+    const uint8_t* in = src + 3*(width - 1);
+    for (int j = 0; j < width; j++, in = in - 3)
+    {
+        dst[3*j] = in[0];
+        dst[3*j + 1] = in[1];
+        dst[3*j + 2] = in[2];
+    }
+}
+
+/**
+ * Swaps the pixels of two rows, reversing the order of both
+ * @param a     a row
+ * @param b     another row, or the same row to reverse it in place
+ * @param width number of pixels in each row
+ * @return nothing
+ */
+void swap_reversed(uint8_t* a, uint8_t* b, int width)
+{
+    // When a and b are the same row, the middle pixel stays where it is
+    int count = a == b ? width/2 : width;
+    for (int j = 0; j < count; j++)
+    {
+        uint8_t* p = a + 3*j;
+        uint8_t* q = b + 3*(width - 1 - j);
+        for (int c = 0; c < Image::CHANNELS; c++)
+        {
+            swap(p[c], q[c]);
+        }
+    }
+}
+
+/**
+ * Works out how many quarter turns clockwise a rotation makes
+ * @param op process 4 or 5
+ * @return 0, 1, 2 or 3
+ */
+int rotation_turns(const Operation& op)
+{
+    return op.process == 4 ? 1 : quarter_turns(op.rotations);
+}
+
+/**
+ * Copies a band of source rows to their place in an image rotated clockwise.
+ * A half turn reverses each row into its mirrored row, and quarter turns go
+ * tile by tile, each output row of a tile gathering one column of the tile.
+ * @param band       rows first_row onwards of the source image
+ * @param first_row  index in the source image of the band's first row
+ * @param src_height height of the whole source image
+ * @param turns      number of quarter turns (0 to 3)
+ * @param dst        the rotated image
+ * @return nothing
+ */
+void rotate_band(const ImageView& band, int first_row, int src_height, int turns, Image& dst)
+{
+    int src_width = band.width();
+    size_t row_bytes = size_t(src_width) * Image::CHANNELS;
+    if (turns == 0 || turns == 2)
+    {
+        for (int r = 0; r < band.height(); r++)
+        {
+            int i = first_row + r;
+            if (turns == 0)
+            {
+                memcpy(dst.row(i), band.row(r), row_bytes);
+            }
+            else
+            {
+                reverse_pixels(band.row(r), dst.row(src_height - 1 - i), src_width);
+            }
+        }
+        return;
+    }
+
+    for (int r0 = 0; r0 < band.height(); r0 = r0 + ROTATE_TILE)
+    {
+        int r1 = min(r0 + ROTATE_TILE, band.height());
+        for (int j0 = 0; j0 < src_width; j0 = j0 + ROTATE_TILE)
+        {
+            int j1 = min(j0 + ROTATE_TILE, src_width);
+            for (int j = j0; j < j1; j++)
+            {
+                // A clockwise turn puts row i of the input in column (src_height - 1 - i)
+                // of output row j, so the tile's rows run right to left; three turns put
+                // it in column i of output row (src_width - 1 - j), left to right
+                uint8_t* out;
+                ptrdiff_t step;
+                if (turns == 1)
+                {
+                    out = dst.row(j) + 3*(src_height - 1 - (first_row + r0));
+                    step = -3;
+                }
+                else
+                {
+                    out = dst.row(src_width - 1 - j) + 3*(first_row + r0);
+                    step = 3;
+                }
+                for (int r = r0; r < r1; r++, out = out + step)
+                {
+                    const uint8_t* in = band.row(r) + 3*j;
+                    out[0] = in[0];
+                    out[1] = in[1];
+                    out[2] = in[2];
+                }
+            }
+        }
+    }
+}
+
+/**
+ * Rotates an image clockwise without a second buffer. A half turn swaps each
+ * row with its mirrored row, reversed; quarter turns transpose the image tile
+ * by tile and then mirror it, so they need a square image.
+ * @param image the image
+ * @param turns number of quarter turns (0 to 3)
+ * @return False if a quarter turn was asked of an image that is not square
+ */
+bool rotate_in_place(Image& image, int turns)
+{
+    int width = image.width();
+    int height = image.height();
+    if (turns % 2 == 1 && width != height)
+    {
+        return false;
+    }
+    size_t row_bytes = size_t(width) * Image::CHANNELS;
+    if (turns == 2)
+    {
+        parallel_bands((height + 1)/2, 2*row_bytes, (height + 1)/2, 1, [&](int first, int rows, int) {
+            for (int i = first; i < first + rows; i++)
+            {
+                swap_reversed(image.row(i), image.row(height - 1 - i), width);
+            }
+        });
+        return true;
+    }
+    if (turns == 0)
+    {
+        return true;
+    }
+
+    // Each row of tiles only swaps with its own column of tiles, so rows of tiles can go in parallel
+    int tile_rows = (height + ROTATE_TILE - 1) / ROTATE_TILE;
+    thread_pool().parallel_for(tile_rows, [&](int tile_row, int) {
+        int i0 = tile_row * ROTATE_TILE;
+        for (int j0 = i0; j0 < width; j0 = j0 + ROTATE_TILE)
+        {
+            // Swap the tile at (i0, j0) with its mirror at (j0, i0), above the diagonal only
+            for (int i = i0; i < min(i0 + ROTATE_TILE, height); i++)
+            {
+                for (int j = max(j0, i + 1); j < min(j0 + ROTATE_TILE, width); j++)
+                {
+                    uint8_t* p = image.row(i) + 3*j;
+                    uint8_t* q = image.row(j) + 3*i;
+                    for (int c = 0; c < Image::CHANNELS; c++)
+                    {
+                        swap(p[c], q[c]);
+                    }
+                }
+            }
+        }
+    });
+
+    // One turn mirrors the transpose left to right, three turns top to bottom
+    int mirrored = turns == 1 ? height : height/2;
+    parallel_bands(mirrored, row_bytes, mirrored, 1, [&](int first, int rows, int) {
+        for (int i = first; i < first + rows; i++)
+        {
+            if (turns == 1)
+            {
+                swap_reversed(image.row(i), image.row(i), width);
+            }
+            else
+            {
+                swap_ranges(image.row(i), image.row(i) + row_bytes, image.row(height - 1 - i));
+            }
+        }
+    });
+    return true;
+}
+
+/**
+ * How one side of a downscaled image covers the pixels along the same side
+ * of the source. Measured in units of 1/(size*new_size) of the side, source
+ * pixel k covers [k*new_size, (k+1)*new_size) and output pixel x covers
+ * [x*size, (x+1)*size), so every overlap is a whole number of units and the
+ * overlaps of one output pixel add up to size.
+ */
+struct AreaSpan
+{
+    int first;          // first source pixel wholly inside the output pixel
+    int end;            // one past the last source pixel wholly inside it
+    int first_weight;   // overlap of source pixel first - 1, or 0 if it is not inside
+    int end_weight;     // overlap of source pixel end, or 0 if it is not inside
+};
+
+/**
+ * Works out how the pixels along one side of a downscaled image cover the source
+ * @param size     number of source pixels
+ * @param new_size number of output pixels, 1 to size
+ * @return a span for each output pixel
+ */
+vector<AreaSpan> area_spans(int size, int new_size)
+{
+    vector<AreaSpan> spans(new_size);
+    for (int x = 0; x < new_size; x++)
+    {
+        int64_t begin = int64_t(x) * size;
+        int64_t stop = begin + size;
+        AreaSpan& span = spans[x];
+        span.first = int((begin + new_size - 1) / new_size);
+        span.end = int(stop / new_size);
+        span.first_weight = int(int64_t(span.first) * new_size - begin);
+        span.end_weight = int(stop - int64_t(span.end) * new_size);
+    }
+    return spans;
+}
+
+// Rows of 255 that can be added up before a 32-bit column sum could overflow
+const int MAX_ACCUMULATED_ROWS = 1 << 24;
+
+// Bytes of source rows added up at a time, so their column sums stay in the L1 cache
+const size_t ACCUMULATE_BYTES = 4096;
+
+/**
+ * Downscales an image by area averaging, one row of the result at a time,
+ * each made from the few source rows it covers. Source rows wholly inside
+ * the output row are added up column by column first, which the vector
+ * kernels do at the speed the rows can be read; only then are the columns of
+ * each output pixel added up, once per row of the result rather than once
+ * per source row. The filter holds no state between rows, so threads can
+ * make different rows with one filter, each with its own Scratch.
+ */
+class AreaFilter
+{
+public:
+    // Sums for one row of the result
+    struct Scratch
+    {
+        vector<uint32_t> counts;    // column sums of the source rows wholly inside
+        vector<uint64_t> totals;    // the output pixels' channels, in units of 1/area
+    };
+
+    /**
+     * Prepares a downscale
+     * @param width      width of the source
+     * @param height     height of the source
+     * @param new_width  width of the result, 1 to width
+     * @param new_height height of the result, 1 to height
+     */
+    AreaFilter(int width, int height, int new_width, int new_height)
+        : width_(width), new_width_(new_width), new_height_(new_height), columns_(area_spans(width, new_width)),
+          rows_(area_spans(height, new_height)), area_(uint64_t(width) * height), most_rows_(0)
+    {
+        // Totals plus half the area are below 2^(bits + 8) when the area is at most 2^bits, and
+        // for those, multiplying by this reciprocal and shifting divides exactly (Granlund and
+        // Montgomery, "Division by invariant integers using multiplication", 1994). The area
+        // of any image that fits in memory or a file is far below the 2^55 this allows.
+        int bits = 0;
+        while ((uint64_t(1) << bits) < area_)
+        {
+            bits++;
+        }
+        shift_ = 2*bits + 8;
+        reciprocal_ = uint64_t(((unsigned __int128)1 << shift_) / area_ + 1);
+        for (int y = 0; y < new_height; y++)
+        {
+            most_rows_ = max(most_rows_, end_source_row(y) - first_source_row(y));
+        }
+    }
+
+    // Source rows first_source_row(y) to end_source_row(y) - 1 make row y of the result
+    int first_source_row(int y) const { return rows_[y].first - (rows_[y].first_weight != 0); }
+    int end_source_row(int y) const { return rows_[y].end + (rows_[y].end_weight != 0); }
+
+    // Most source rows one row of the result is made from
+    int most_rows() const { return most_rows_; }
+
+    /**
+     * Makes one row of the result
+     * @param y       index of the row
+     * @param source  source(i) gives source row i, for each row the output row covers
+     * @param scratch sums, sized as needed
+     * @param dst     the row of the result
+     * @return nothing
+     */
+    template <class Source>
+    void make_row(int y, Source source, Scratch& scratch, uint8_t* dst) const
+    {
+        size_t count = size_t(width_) * Image::CHANNELS;
+        scratch.counts.resize(count);
+        scratch.totals.assign(size_t(new_width_) * Image::CHANNELS, 0);
+        uint32_t* counts = scratch.counts.data();
+        const AreaSpan& span = rows_[y];
+        const PixelKernels& kernels = pixel_kernels();
+
+        // Rows wholly inside all weigh new_height, so they are added up first and weighed once
+        for (int first = span.first; first < span.end; first = first + MAX_ACCUMULATED_ROWS)
+        {
+            int end = min(span.end, first + MAX_ACCUMULATED_ROWS);
+            for (size_t k = 0; k < count; k = k + ACCUMULATE_BYTES)
+            {
+                size_t bytes = min(ACCUMULATE_BYTES, count - k);
+                fill(counts + k, counts + k + bytes, 0);
+                for (int i = first; i < end; i++)
+                {
+                    kernels.accumulate(source(i) + k, counts + k, bytes);
+                }
+            }
+            add_columns(counts, new_height_, scratch.totals.data());
+        }
+        if (span.first_weight != 0)
+        {
+            add_columns(source(span.first - 1), span.first_weight, scratch.totals.data());
+        }
+        if (span.end_weight != 0)
+        {
+            add_columns(source(span.end), span.end_weight, scratch.totals.data());
+        }
+        for (size_t k = 0; k < scratch.totals.size(); k++)
+        {
+            dst[k] = divide(scratch.totals[k]);
+        }
+    }
+
+private:
+    /**
+     * Adds up the columns of each output pixel and adds them to its totals,
+     * weighing them by how much of a row of the result the columns' rows cover
+     * @param src    column sums, or a source row
+     * @param weight the weight of the rows
+     * @param totals the totals of the output pixels
+     * @return nothing
+     */
+    template <class T>
+    void add_columns(const T* src, uint64_t weight, uint64_t* totals) const
+    {
+        uint64_t whole = uint64_t(new_width_) * weight;
+        for (int x = 0; x < new_width_; x++, totals = totals + 3)
+        {
+            const AreaSpan& column = columns_[x];
+            uint64_t sums[3] = {0, 0, 0};
+            for (const T* in = src + 3*column.first; in < src + 3*column.end; in = in + 3)
+            {
+                sums[0] = sums[0] + in[0];
+                sums[1] = sums[1] + in[1];
+                sums[2] = sums[2] + in[2];
+            }
+            totals[0] = totals[0] + sums[0] * whole;
+            totals[1] = totals[1] + sums[1] * whole;
+            totals[2] = totals[2] + sums[2] * whole;
+            if (column.first_weight != 0 || column.end_weight != 0)
+            {
+                // Columns partly inside (at the edges of the image the weight is 0 and nothing is read)
+                const T* left = src + 3*(column.first - (column.first_weight != 0));
+                const T* right = src + 3*(column.end - (column.end_weight == 0));
+                uint64_t left_weight = column.first_weight * weight;
+                uint64_t right_weight = column.end_weight * weight;
+                for (int c = 0; c < Image::CHANNELS; c++)
+                {
+                    totals[c] = totals[c] + left[c] * left_weight + right[c] * right_weight;
+                }
+            }
+        }
+    }
+
+    // Divides a total by the area, rounding to nearest
+    uint8_t divide(uint64_t total) const
+    {
+        return uint8_t((unsigned __int128)(total + area_/2) * reciprocal_ >> shift_);
+    }
+
+    int width_;
+    int new_width_;
+    int new_height_;
+    vector<AreaSpan> columns_;
+    vector<AreaSpan> rows_;
+    uint64_t area_;         // units in a pixel of the result: width * height
+    uint64_t reciprocal_;   // 2^shift_ / area_, rounded up
+    int shift_;
+    int most_rows_;
+};
+
+void downscale_size(int image_width, int image_height, int width, int height, int& new_width, int& new_height)
+{
+    width = max(width, 1);
+    height = max(height, 1);
+    if (image_width <= 0 || image_height <= 0)
+    {
+        new_width = 0;
+        new_height = 0;
+    }
+    else if (image_width <= width && image_height <= height)
+    {
+        new_width = image_width;
+        new_height = image_height;
+    }
+    else if (int64_t(image_width) * height >= int64_t(image_height) * width)
+    {
+        // The width is what limits the size
+        new_width = width;
+        new_height = int(max<int64_t>(1, (int64_t(image_height) * width + image_width/2) / image_width));
+    }
+    else
+    {
+        new_height = height;
+        new_width = int(max<int64_t>(1, (int64_t(image_width) * height + image_height/2) / image_height));
+    }
+}
+
+/**
+ * Downscales an image by area averaging, first applying a list of per-pixel
+ * processes to each source row on the way in. Bands of rows of the result go
+ * to different threads, each reading only the source rows its band covers.
+ * @param image    the input image
+ * @param pre      per-pixel processes to apply first, in order (may be empty)
+ * @param newimage the result, already the size wanted (not the image viewed as the input)
+ * @return nothing
+ */
+void downscale_image(const ImageView& image, const vector<Operation>& pre, Image& newimage)
+{
+    int width = image.width();
+    int height = image.height();
+    AreaFilter filter(width, height, newimage.width(), newimage.height());
+    PointProgram program(pre, width, height);
+    ThreadPool& pool = thread_pool();
+    vector<AreaFilter::Scratch> scratch(pool.size());
+    vector<Image> processed(pool.size());
+    size_t source_bytes = size_t(width) * Image::CHANNELS * filter.most_rows();
+    parallel_bands(newimage.height(), source_bytes, newimage.height(), 1, [&](int first, int rows, int worker) {
+        for (int y = first; y < first + rows; y++)
+        {
+            int first_row = filter.first_source_row(y);
+            if (pre.empty())
+            {
+                filter.make_row(y, [&](int i) { return image.row(i); }, scratch[worker], newimage.row(y));
+                continue;
+            }
+
+            // The per-pixel processes go into a buffer of the rows this output row covers
+            Image& rows_buffer = processed[worker];
+            if (rows_buffer.empty())
+            {
+                rows_buffer = Image::uninitialized(width, filter.most_rows());
+            }
+            for (int i = first_row; i < filter.end_source_row(y); i++)
+            {
+                program.run_row(image.row(i), rows_buffer.row(i - first_row), width, i);
+            }
+            filter.make_row(y, [&](int i) { return rows_buffer.row(i - first_row); }, scratch[worker],
+                            newimage.row(y));
+        }
+    });
+}
+
+/**
+ * Where the pixels along one side of an enlarged image come from. For nearest
+ * neighbour, output pixel i is source pixel first[i]. For bilinear, it blends
+ * first[i] and the pixel after it, which has weight[i] out of 256.
+ */
+struct EnlargeAxis
+{
+    vector<int> first;
+    vector<int> weight;
+
+    /**
+     * Works out the source pixels of one side
+     * @param size     number of source pixels
+     * @param new_size number of output pixels
+     * @param whole    the scale factor if it is a whole number given as one, and 0 otherwise
+     * @param factor   the scale factor
+     * @param filter   ENLARGE_NEAREST or ENLARGE_BILINEAR
+     */
+    EnlargeAxis(int size, int new_size, int whole, double factor, int filter)
+        : first(new_size), weight(new_size)
+    {
+        for (int i = 0; i < new_size; i++)
+        {
+            if (filter == ENLARGE_NEAREST)
+            {
+                first[i] = min(whole != 0 ? i / whole : int(i / factor), size - 1);
+                continue;
+            }
+
+            // The centre of output pixel i is at position/scale in source pixels, from the centre of the first
+            int64_t position = (2*int64_t(i) + 1) * size - new_size;
+            int64_t scale = 2*int64_t(new_size);
+            int64_t pixel = position < 0 ? 0 : position / scale;
+            int64_t part = position < 0 ? 0 : ((position % scale) * 256 + scale/2) / scale;
+            pixel = part == 256 ? pixel + 1 : pixel;
+            part = part == 256 || pixel >= size - 1 ? 0 : part;
+            first[i] = int(min<int64_t>(pixel, size - 1));
+            weight[i] = int(part);
+        }
+    }
+};
+
+/**
+ * Enlarges an image, first applying a list of per-pixel processes to each
+ * source row on the way in. Bands of rows of the result go to different
+ * threads. Each source row a thread needs is processed and stretched
+ * across once, and an output row that repeats the one above is copied.
+ * @param image    the input image
+ * @param pre      per-pixel processes to apply first, in order (may be empty)
+ * @param op       process 6
+ * @param newimage the result, already the size wanted (not the image viewed as the input)
+ * @return nothing
+ */
+void enlarge_image(const ImageView& image, const vector<Operation>& pre, const Operation& op, Image& newimage)
+{
+    int width = image.width();
+    int height = image.height();
+    int new_width = newimage.width();
+    bool fractional = op.xfactor != 0 || op.yfactor != 0;
+    double xfactor = fractional ? op.xfactor : op.xscale;
+    double yfactor = fractional ? op.yfactor : op.yscale;
+    int xwhole = !fractional ? op.xscale : (xfactor == int(xfactor) ? int(xfactor) : 0);
+    int ywhole = fractional ? 0 : op.yscale;
+    bool bilinear = op.filter == ENLARGE_BILINEAR;
+    EnlargeAxis columns(width, new_width, xwhole, xfactor, op.filter);
+    EnlargeAxis rows(height, newimage.height(), ywhole, yfactor, op.filter);
+
+    // A whole horizontal factor repeats pixels with the vector kernel; any other
+    // picks pixels through the column table
+    bool replicate = !bilinear && xwhole > 0 && int64_t(width) * xwhole == new_width;
+    PixelKernels kernels = pixel_kernels();
+    PointProgram program(pre, width, height);
+    size_t new_row_bytes = size_t(new_width) * Image::CHANNELS;
+
+    // Each thread keeps its processed source row and, for bilinear, two source rows blended across
+    struct Scratch
+    {
+        Image processed;
+        vector<uint16_t> blended[2];
+        int blended_row[2];
+    };
+    vector<Scratch> scratch(thread_pool().size());
+    auto source_row = [&](int i, Scratch& mine) {
+        if (pre.empty())
+        {
+            return image.row(i);
+        }
+        if (mine.processed.empty())
+        {
+            mine.processed = Image::uninitialized(width, 1);
+        }
+        program.run_row(image.row(i), mine.processed.row(0), width, i);
+        return static_cast<const uint8_t*>(mine.processed.row(0));
+    };
+    auto blended_row = [&](int i, int slot, Scratch& mine) {
+        vector<uint16_t>& out = mine.blended[slot];
+        if (mine.blended_row[slot] != i)
+        {
+            const uint8_t* src = source_row(i, mine);
+            for (int j = 0; j < new_width; j++)
+            {
+                const uint8_t* left = src + 3*columns.first[j];
+                const uint8_t* right = left + (columns.first[j] + 1 < width ? 3 : 0);
+                int w = columns.weight[j];
+                for (int c = 0; c < 3; c++)
+                {
+                    out[3*j + c] = uint16_t(left[c]*(256 - w) + right[c]*w);
+                }
+            }
+            mine.blended_row[slot] = i;
+        }
+        return out.data();
+    };
+
+    parallel_bands(newimage.height(), new_row_bytes, newimage.height(), 1, [&](int first, int count, int worker) {
+        Scratch& mine = scratch[worker];
+        if (bilinear && mine.blended[0].empty())
+        {
+            mine.blended[0].resize(new_row_bytes);
+            mine.blended[1].resize(new_row_bytes);
+            mine.blended_row[0] = -1;
+            mine.blended_row[1] = -1;
+        }
+        for (int y = first; y < first + count; y++)
+        {
+            uint8_t* dst = newimage.row(y);
+            int i = rows.first[y];
+            if (y > first && i == rows.first[y - 1] && rows.weight[y] == rows.weight[y - 1])
+            {
+                memcpy(dst, newimage.row(y - 1), new_row_bytes);
+            }
+            else if (bilinear)
+            {
+                // The two rows take alternate slots, so moving down one row blends only the new one
+                int w = rows.weight[y];
+                const uint16_t* top = blended_row(i, i % 2, mine);
+                const uint16_t* bottom = w == 0 ? top : blended_row(i + 1, (i + 1) % 2, mine);
+                for (size_t k = 0; k < new_row_bytes; k++)
+                {
+                    dst[k] = uint8_t((uint32_t(top[k])*(256 - w) + uint32_t(bottom[k])*w + 32768) >> 16);
+                }
+            }
+            else if (replicate)
+            {
+                kernels.replicate(source_row(i, mine), dst, width, xwhole);
+            }
+            else
+            {
+                const uint8_t* src = source_row(i, mine);
+                for (int j = 0; j < new_width; j++)
+                {
+                    memcpy(dst + 3*j, src + 3*columns.first[j], 3);
+                }
+            }
+        }
+    });
+}
+
+/**
+ * Works out the size of the image a rotation, enlargement or downscale produces.
+ * An enlargement with a side too big for an int produces an empty image, 0 by 0.
+ * @param op     process 4, 5, 6 or DOWNSCALE_PROCESS
+ * @param width  width of the input image
+ * @param height height of the input image
+ * @param new_width  receives the width of the output image
+ * @param new_height receives the height of the output image
+ * @return nothing
+ */
+void geometric_size(const Operation& op, int width, int height, int& new_width, int& new_height)
+{
+    int turns = rotation_turns(op);
+    if (op.process == 6)
+    {
+        bool fractional = op.xfactor != 0 || op.yfactor != 0;
+        double x = fractional ? width * op.xfactor : double(width) * op.xscale;
+        double y = fractional ? height * op.yfactor : double(height) * op.yscale;
+        bool fits = x < double(INT_MAX) + 1 && y < double(INT_MAX) + 1;
+        new_width = fits ? int(x) : 0;
+        new_height = fits ? int(y) : 0;
+    }
+    else if (op.process == DOWNSCALE_PROCESS)
+    {
+        downscale_size(width, height, op.width, op.height, new_width, new_height);
+    }
+    else if (turns % 2 == 1)
+    {
+        new_width = height;
+        new_height = width;
+    }
+    else
+    {
+        new_width = width;
+        new_height = height;
+    }
+}
+
+/**
+ * Rotates, enlarges or downscales an image, first applying a list of per-pixel
+ * processes to each band of source rows on the way in. The per-pixel results
+ * only ever exist one band at a time, so the output image is the only full-size image made.
+ * @param image      the input image
+ * @param pre        per-pixel processes to apply first, in order (may be empty)
+ * @param op         process 4, 5, 6 or DOWNSCALE_PROCESS
+ * @param newimage   receives the result, reusing its buffer if big enough
+ *                   (not the image viewed as the input)
+ * @param band_bytes memory to use for bands of processed source rows
+ * @return nothing
+ */
+void apply_geometric(const ImageView& image, const vector<Operation>& pre, const Operation& op, Image& newimage,
+                     size_t band_bytes = DEFAULT_BAND_BYTES)
+{
+    StageTimer timer("process");
+    if (timer.active())
+    {
+        vector<Operation> fused = pre;
+        fused.push_back(op);
+        timer.rename(stage_name(fused));
+        timer.add_pixels((unsigned long long)image.width() * image.height());
+    }
+    int new_width;
+    int new_height;
+    geometric_size(op, image.width(), image.height(), new_width, new_height);
+    newimage.resize_uninitialized(new_width, new_height);
+    if (newimage.empty() || image.empty())
+    {
+        return;
+    }
+    if (op.process == DOWNSCALE_PROCESS)
+    {
+        downscale_image(image, pre, newimage);
+        return;
+    }
+    if (op.process == 6)
+    {
+        enlarge_image(image, pre, op, newimage);
+        return;
+    }
+
+    // Bands of source rows go to different threads. A band lands in its own
+    // columns of the rotated image, so no two threads write the same pixels,
+    // and bands are whole numbers of tiles.
+    // Each thread has a buffer for its band of processed rows, and together
+    // they stay within band_bytes.
+    ThreadPool& pool = thread_pool();
+    size_t row_bytes = size_t(image.width()) * Image::CHANNELS;
+    size_t thread_bytes = band_bytes / pool.size();
+    int band_rows = pre.empty() ? image.height()
+                                : int(min<size_t>(image.height(), max<size_t>(1, thread_bytes / row_bytes)));
+    vector<Image> band_buffers(pool.size());
+    PointProgram program(pre, image.width(), image.height());
+
+    parallel_bands(image.height(), row_bytes, band_rows, ROTATE_TILE, [&](int first, int rows, int worker) {
+        ImageView band(image.row(first), image.width(), rows, image.stride());
+        if (!pre.empty())
+        {
+            Image& band_buffer = band_buffers[worker];
+            if (band_buffer.empty())
+            {
+                band_buffer = Image::uninitialized(image.width(), band_rows);
+            }
+            for (int r = 0; r < rows; r++)
+            {
+                program.run_row(band.row(r), band_buffer.row(r), image.width(), first + r);
+            }
+            band = ImageView(band_buffer.data(), image.width(), rows, band_buffer.stride());
+        }
+        rotate_band(band, first, image.height(), rotation_turns(op), newimage);
+    });
+
+}
+
+/**
+ * Rotates, enlarges or downscales an image into a new image, first applying
+ * a list of per-pixel processes to each band of source rows on the way in
+ * @param image      the input image
+ * @param pre        per-pixel processes to apply first, in order (may be empty)
+ * @param op         process 4, 5, 6 or DOWNSCALE_PROCESS
+ * @param band_bytes memory to use for bands of processed source rows
+ * @return the new image
+ */
+Image apply_geometric(const ImageView& image, const vector<Operation>& pre, const Operation& op,
+                      size_t band_bytes = DEFAULT_BAND_BYTES)
+{
+    Image newimage;
+    apply_geometric(image, pre, op, newimage, band_bytes);
+    return newimage;
+}
+
+Image process_1(const ImageView& image)
+{
+    return apply_point_ops(image, {Operation{1}});
+}
+
+Image process_2(const ImageView& image, double scaling_factor)
+{
+    return apply_point_ops(image, {Operation{2, scaling_factor}});
+}
+
+Image process_3(const ImageView& image)
+{
+    return apply_point_ops(image, {Operation{3}});
+}
+
+Image process_4(const ImageView& image)
+{
+    // The rotated image swaps the height and width
+    return apply_geometric(image, {}, Operation{4});
+}
+
+Image process_5(const ImageView& image, int number)
+{
+    return apply_geometric(image, {}, Operation{5, 0, number});
+}
+
+Image process_6(const ImageView& image, int xscale, int yscale)
+{
+    return apply_geometric(image, {}, Operation{6, 0, 0, xscale, yscale});
+}
+
+Image process_7(const ImageView& image)
+{
+    return apply_point_ops(image, {Operation{7}});
+}
+
+Image process_8(const ImageView& image, double scaling_factor)
+{
+    return apply_point_ops(image, {Operation{8, scaling_factor}});
+}
+
+Image process_9(const ImageView& image, double scaling_factor)
+{
+    return apply_point_ops(image, {Operation{9, scaling_factor}});
+}
+
+Image process_10(const ImageView& image)
+{
+    return apply_point_ops(image, {Operation{10}});
+}
+
+void process_1(const ImageView& image, Image& output)
+{
+    apply_point_ops(image, {Operation{1}}, output);
+}
+
+void process_2(const ImageView& image, double scaling_factor, Image& output)
+{
+    apply_point_ops(image, {Operation{2, scaling_factor}}, output);
+}
+
+void process_3(const ImageView& image, Image& output)
+{
+    apply_point_ops(image, {Operation{3}}, output);
+}
+
+void process_4(const ImageView& image, Image& output)
+{
+    apply_geometric(image, {}, Operation{4}, output);
+}
+
+void process_5(const ImageView& image, int number, Image& output)
+{
+    apply_geometric(image, {}, Operation{5, 0, number}, output);
+}
+
+void process_6(const ImageView& image, int xscale, int yscale, Image& output)
+{
+    apply_geometric(image, {}, Operation{6, 0, 0, xscale, yscale}, output);
+}
+
+void process_7(const ImageView& image, Image& output)
+{
+    apply_point_ops(image, {Operation{7}}, output);
+}
+
+void process_8(const ImageView& image, double scaling_factor, Image& output)
+{
+    apply_point_ops(image, {Operation{8, scaling_factor}}, output);
+}
+
+void process_9(const ImageView& image, double scaling_factor, Image& output)
+{
+    apply_point_ops(image, {Operation{9, scaling_factor}}, output);
+}
+
+void process_10(const ImageView& image, Image& output)
+{
+    apply_point_ops(image, {Operation{10}}, output);
+}
+
+void process_1_in_place(Image& image)
+{
+    apply_point_ops_in_place(image, {Operation{1}});
+}
+
+void process_2_in_place(Image& image, double scaling_factor)
+{
+    apply_point_ops_in_place(image, {Operation{2, scaling_factor}});
+}
+
+void process_3_in_place(Image& image)
+{
+    apply_point_ops_in_place(image, {Operation{3}});
+}
+
+void process_7_in_place(Image& image)
+{
+    apply_point_ops_in_place(image, {Operation{7}});
+}
+
+void process_8_in_place(Image& image, double scaling_factor)
+{
+    apply_point_ops_in_place(image, {Operation{8, scaling_factor}});
+}
+
+void process_9_in_place(Image& image, double scaling_factor)
+{
+    apply_point_ops_in_place(image, {Operation{9, scaling_factor}});
+}
+
+void process_10_in_place(Image& image)
+{
+    apply_point_ops_in_place(image, {Operation{10}});
+}
+
+Image downscale(const ImageView& image, int width, int height)
+{
+    Image newimage;
+    downscale(image, width, height, newimage);
+    return newimage;
+}
+
+void downscale(const ImageView& image, int width, int height, Image& output)
+{
+    StageTimer timer("process");
+    if (timer.active())
+    {
+        timer.rename("process_" + to_string(DOWNSCALE_PROCESS));
+        timer.add_pixels((unsigned long long)image.width() * image.height());
+    }
+    output.resize_uninitialized(min(max(width, 1), image.width()), min(max(height, 1), image.height()));
+    if (!output.empty())
+    {
+        downscale_image(image, {}, output);
+    }
+}
+
+Image enlarge(const ImageView& image, double xfactor, double yfactor, int filter)
+{
+    Image newimage;
+    enlarge(image, xfactor, yfactor, filter, newimage);
+    return newimage;
+}
+
+void enlarge(const ImageView& image, double xfactor, double yfactor, int filter, Image& output)
+{
+    Operation op{6};
+    op.xfactor = xfactor;
+    op.yfactor = yfactor;
+    op.filter = filter;
+    apply_geometric(image, {}, op, output);
+}
+
+//***************************************************************************************************//
+//                                    OPERATION CHAINS                                               //
+//***************************************************************************************************//
+
+// Command line names of the processes, indexed by menu number
+const char* const PROCESS_NAMES[] = {"", "vignette", "clarendon", "grayscale", "rotate90", "rotate",
+                                     "enlarge", "highcontrast", "lighten", "darken", "bwrgb", "downscale"};
+
+bool parse_int(const string& text, int& value)
+{
+    char* end = nullptr;
+    long parsed = strtol(text.c_str(), &end, 10);
+    value = int(parsed);
+    return !text.empty() && *end == '\0' && parsed >= INT_MIN && parsed <= INT_MAX;
+}
+
+bool parse_operation(const string& text, Operation& op)
+{
+    size_t colon = text.find(':');
+    string name = text.substr(0, colon);
+    string parameters = colon == string::npos ? "" : text.substr(colon + 1);
+    op = Operation{0};
+    for (int process = 1; process <= DOWNSCALE_PROCESS; process++)
+    {
+        if (name == PROCESS_NAMES[process] || name == to_string(process))
+        {
+            op.process = process;
+        }
+    }
+
+    if (op.process == 2 || op.process == 8 || op.process == 9)
+    {
+        char* end = nullptr;
+        op.scaling_factor = strtod(parameters.c_str(), &end);
+        return !parameters.empty() && *end == '\0' && isfinite(op.scaling_factor);
+    }
+    else if (op.process == 5)
+    {
+        return parse_int(parameters, op.rotations);
+    }
+    else if (op.process == 6)
+    {
+        // Whole factors are kept as such, and any others as fractions
+        size_t comma = parameters.find(',');
+        size_t filter_comma = comma == string::npos ? string::npos : parameters.find(',', comma + 1);
+        string x = parameters.substr(0, comma);
+        string y = comma == string::npos ? "" : parameters.substr(comma + 1, filter_comma - comma - 1);
+        string filter = filter_comma == string::npos ? "nearest" : parameters.substr(filter_comma + 1);
+        op.filter = filter == "bilinear" ? ENLARGE_BILINEAR : ENLARGE_NEAREST;
+        if (comma == string::npos || (filter != "nearest" && filter != "bilinear"))
+        {
+            return false;
+        }
+        if (parse_int(x, op.xscale) && parse_int(y, op.yscale))
+        {
+            return op.xscale > 0 && op.yscale > 0;
+        }
+        char* x_end = nullptr;
+        char* y_end = nullptr;
+        op.xscale = 0;
+        op.yscale = 0;
+        op.xfactor = strtod(x.c_str(), &x_end);
+        op.yfactor = strtod(y.c_str(), &y_end);
+        return !x.empty() && !y.empty() && *x_end == '\0' && *y_end == '\0' && op.xfactor > 0 && op.yfactor > 0
+            && op.xfactor <= INT_MAX && op.yfactor <= INT_MAX;
+    }
+    else if (op.process == DOWNSCALE_PROCESS)
+    {
+        // One size is a square box
+        size_t comma = parameters.find(',');
+        bool valid = comma == string::npos ? parse_int(parameters, op.width)
+                                           : parse_int(parameters.substr(0, comma), op.width)
+                                             && parse_int(parameters.substr(comma + 1), op.height);
+        op.height = comma == string::npos ? op.width : op.height;
+        return valid && op.width > 0 && op.height > 0;
+    }
+    return op.process != 0 && colon == string::npos;
+}
+
+Image run_operations(const ImageView& image, const vector<Operation>& ops)
+{
+    // Results alternate between two buffers, so a chain of any length needs two
+    Image current;
+    Image spare;
+    bool owned = false;
+    size_t k = 0;
+    while (k < ops.size())
+    {
+        // Collect the per-pixel processes up to the next rotation or enlargement
+        vector<Operation> point_ops;
+        while (k < ops.size() && is_point_process(ops[k].process))
+        {
+            point_ops.push_back(ops[k]);
+            k++;
+        }
+
+        ImageView input = owned ? current.view() : image;
+        if (k < ops.size())
+        {
+            // A rotation that keeps the image's shape is done in the buffer it already has
+            int turns = rotation_turns(ops[k]);
+            if (owned && (ops[k].process == 4 || ops[k].process == 5)
+                && (turns % 2 == 0 || current.width() == current.height()))
+            {
+                apply_point_ops_in_place(current, point_ops);
+                rotate_in_place(current, turns);
+            }
+            else
+            {
+                apply_geometric(input, point_ops, ops[k], spare);
+                swap(current, spare);
+            }
+            k++;
+        }
+        else if (owned)
+        {
+            apply_point_ops_in_place(current, point_ops);
+        }
+        else
+        {
+            apply_point_ops(input, point_ops, current);
+        }
+        owned = true;
+    }
+    return owned ? move(current) : Image(image);
+}
+
+bool stream_point_ops(const string& input, const string& output, const vector<Operation>& ops, size_t band_bytes)
+{
+    for (size_t k = 0; k < ops.size(); k++)
+    {
+        if (!is_point_process(ops[k].process))
+        {
+            return false;
+        }
+    }
+    // Reading, processing and writing are interleaved band by band, so they are timed as one stage
+    StageTimer timer("stream");
+    if (timer.active())
+    {
+        timer.rename("stream:" + stage_name(ops));
+    }
+
+    int in_fd = open(input.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+
+    unsigned char header[BMP_HEADER_BYTES];
+    struct stat in_status;
+    struct stat out_status;
+    BmpInfo info;
+    if (!read_fully(in_fd, header, BMP_HEADER_BYTES) || fstat(in_fd, &in_status) != 0
+        || !parse_bmp_header(header, in_status.st_size, info)
+        || lseek(in_fd, info.start, SEEK_SET) != info.start
+        || (stat(output.c_str(), &out_status) == 0 && out_status.st_dev == in_status.st_dev
+            && out_status.st_ino == in_status.st_ino))
+    {
+        close(in_fd);
+        return false;
+    }
+
+    OutputFile out_file;
+    if (!open_output(output, out_file))
+    {
+        close(in_fd);
+        return false;
+    }
+    int out_fd = out_file.fd;
+
+    int width = info.width;
+    int height = info.height;
+    size_t in_row_bytes = info.row_bytes;
+    size_t scanline_size = size_t(width) * Image::CHANNELS;
+    size_t out_row_bytes = scanline_size + (4 - scanline_size % 4) % 4;
+    int band_rows = int(min<size_t>(height, max<size_t>(1, band_bytes / in_row_bytes)));
+    vector<uint8_t> band(in_row_bytes * band_rows);
+    // Input with alpha is unpacked into a second band, so rows can be done in any order
+    vector<uint8_t> out_band(info.bytes_per_pixel == Image::CHANNELS ? 0 : out_row_bytes * band_rows);
+    uint8_t* out_data = out_band.empty() ? band.data() : out_band.data();
+    PointProgram program(ops, width, height);
+
+    unsigned char out_header[HEADERS_SIZE];
+    make_bmp_header(out_header, width, height);
+    bool ok = write_fully(out_fd, out_header, HEADERS_SIZE);
+
+    for (int first = 0; first < height && ok; first = first + band_rows)
+    {
+        int rows = min(band_rows, height - first);
+        ok = read_fully(in_fd, band.data(), in_row_bytes * rows);
+        if (!ok)
+        {
+            break;
+        }
+        parallel_bands(rows, out_row_bytes, rows, 1, [&](int begin, int count, int) {
+            for (int r = begin; r < begin + count; r++)
+            {
+                const uint8_t* src = band.data() + in_row_bytes * r;
+                uint8_t* dst = out_data + out_row_bytes * r;
+                if (info.bytes_per_pixel != Image::CHANNELS)
+                {
+                    unpack_scanline(src, dst, width, info.bytes_per_pixel);
+                }
+                // BMP files store pixels from bottom to top
+                program.run_row(dst, dst, width, height - 1 - (first + r));
+                memset(dst + scanline_size, 0, out_row_bytes - scanline_size);
+            }
+        });
+        ok = write_fully(out_fd, out_data, out_row_bytes * rows);
+    }
+
+    timer.add_read(info.start + (unsigned long long)in_row_bytes * height);
+    timer.add_written(HEADERS_SIZE + (unsigned long long)out_row_bytes * height);
+    timer.add_pixels((unsigned long long)width * height);
+    close(in_fd);
+    return close_output(out_file, ok);
+}
+
+/**
+ * Reads a BMP file and downscales it at the same time, a band of scan lines
+ * at a time, first applying a list of per-pixel processes to each scan line.
+ * Only the band and the result are held in memory.
+ * @param input      BMP image filename to read
+ * @param pre        per-pixel processes to apply first, in order (may be empty)
+ * @param op         the downscale
+ * @param image      receives the result
+ * @param band_bytes memory to use for a band of scan lines (a band holds at
+ *                   least the scan lines of one row of the result)
+ * @return True if successful and false otherwise
+ */
+bool read_downscaled(const string& input, const vector<Operation>& pre, const Operation& op, Image& image,
+                     size_t band_bytes)
+{
+    StageTimer timer("read_image");
+    if (timer.active())
+    {
+        vector<Operation> fused = pre;
+        fused.push_back(op);
+        timer.rename("read_image:" + stage_name(fused));
+    }
+
+    int fd = open(input.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+    unsigned char header[BMP_HEADER_BYTES];
+    struct stat status;
+    BmpInfo info;
+    if (!read_fully(fd, header, BMP_HEADER_BYTES) || fstat(fd, &status) != 0
+        || !parse_bmp_header(header, status.st_size, info) || lseek(fd, info.start, SEEK_SET) != info.start)
+    {
+        close(fd);
+        return false;
+    }
+
+    // Area averaging is the same upside down, so the scan lines are taken as
+    // the rows of the image flipped, in the order they are stored, and the
+    // result is made from the bottom row up
+    int width = info.width;
+    int height = info.height;
+    int new_width;
+    int new_height;
+    downscale_size(width, height, op.width, op.height, new_width, new_height);
+    image.resize_uninitialized(new_width, new_height);
+    AreaFilter filter(width, height, new_width, new_height);
+
+    ThreadPool& pool = thread_pool();
+    size_t in_row_bytes = info.row_bytes;
+    int band_rows = int(min<size_t>(height, max<size_t>(filter.most_rows() + 1, band_bytes / in_row_bytes)));
+    vector<uint8_t> band(in_row_bytes * band_rows);
+    vector<AreaFilter::Scratch> scratch(pool.size());
+    PointProgram program(pre, width, height);
+
+    // The band holds scan lines band_first onwards, loaded of them
+    bool ok = true;
+    int band_first = 0;
+    int loaded = 0;
+    int next_read = 0;
+    int next_row = 0;
+    while (next_row < new_height && ok)
+    {
+        int count = min(band_rows - loaded, height - next_read);
+        ok = read_fully(fd, band.data() + in_row_bytes * loaded, in_row_bytes * count);
+        if (!ok)
+        {
+            break;
+        }
+        parallel_bands(count, in_row_bytes, count, 1, [&](int begin, int rows, int) {
+            for (int r = begin; r < begin + rows; r++)
+            {
+                uint8_t* row = band.data() + in_row_bytes * (loaded + r);
+                if (info.bytes_per_pixel != Image::CHANNELS)
+                {
+                    unpack_scanline(row, row, width, info.bytes_per_pixel);
+                }
+                if (!pre.empty())
+                {
+                    program.run_row(row, row, width, height - 1 - (next_read + r));
+                }
+            }
+        });
+        loaded = loaded + count;
+        next_read = next_read + count;
+
+        // Make every row of the result whose scan lines are all in
+        int end_row = next_row;
+        while (end_row < new_height && filter.end_source_row(end_row) <= next_read)
+        {
+            end_row++;
+        }
+        auto source = [&](int i) { return band.data() + in_row_bytes * (i - band_first); };
+        parallel_bands(end_row - next_row, in_row_bytes * filter.most_rows(), end_row - next_row, 1,
+                       [&](int first, int rows, int worker) {
+            for (int y = next_row + first; y < next_row + first + rows; y++)
+            {
+                filter.make_row(y, source, scratch[worker], image.row(new_height - 1 - y));
+            }
+        });
+        next_row = end_row;
+
+        // Keep the scan lines the next row of the result needs
+        if (next_row < new_height)
+        {
+            int keep = filter.first_source_row(next_row);
+            memmove(band.data(), source(keep), in_row_bytes * (next_read - keep));
+            loaded = next_read - keep;
+            band_first = keep;
+        }
+    }
+
+    timer.add_read(info.start + (unsigned long long)in_row_bytes * next_read);
+    timer.add_pixels((unsigned long long)width * next_read);
+    close(fd);
+    return ok;
+}
+
+bool run_pipeline(const string& input, const string& output, const vector<Operation>& ops, size_t band_bytes)
+{
+    bool all_point = true;
+    for (size_t k = 0; k < ops.size(); k++)
+    {
+        all_point = all_point && is_point_process(ops[k].process);
+    }
+    if (all_point)
+    {
+        return stream_point_ops(input, output, ops, band_bytes);
+    }
+
+    // A downscale with only per-pixel processes before it is done as the file is read
+    size_t k = 0;
+    while (k < ops.size() && is_point_process(ops[k].process))
+    {
+        k++;
+    }
+    if (ops[k].process == DOWNSCALE_PROCESS)
+    {
+        Image small;
+        if (!read_downscaled(input, vector<Operation>(ops.begin(), ops.begin() + k), ops[k], small, band_bytes))
+        {
+            return false;
+        }
+        if (k + 1 < ops.size())
+        {
+            small = run_operations(small, vector<Operation>(ops.begin() + k + 1, ops.end()));
+        }
+        return write_image(output, small);
+    }
+
+    MappedBmp mapped;
+    Image decoded;
+    ImageView image = open_input(input, mapped, decoded);
+    if (image.empty() || input == output)
+    {
+        return false;
+    }
+    return write_image(output, run_operations(image, ops));
+}
+
+/**
+ * Averages blocks of 2 by 2 pixels, paired from the left, into a row half as
+ * wide. A last odd pixel is averaged with the one below it only.
+ * @param a     a row
+ * @param b     the row it pairs with, or nullptr if it pairs with itself
+ * @param dst   the row of the result, (width + 1)/2 pixels
+ * @param width number of pixels in the rows
+ * @return nothing
+ */
+void halve_rows(const uint8_t* a, const uint8_t* b, uint8_t* dst, int width)
+{
+    int pairs = width / 2;
+    if (b == nullptr)
+    {
+        for (int k = 0; k < 3*pairs; k++)
+        {
+            int j = k + 3*(k/3);
+            dst[k] = (a[j] + a[j + 3] + 1) >> 1;
+        }
+        memcpy(dst + 3*pairs, a + 6*pairs, width % 2 * 3);
+        return;
+    }
+    for (int k = 0; k < 3*pairs; k++)
+    {
+        // Channel k of the result comes from channel j of a pixel and the same channel of the next one
+        int j = k + 3*(k/3);
+        dst[k] = (a[j] + a[j + 3] + b[j] + b[j + 3] + 2) >> 2;
+    }
+    for (int k = 3*pairs; k < 3*((width + 1)/2); k++)
+    {
+        dst[k] = (a[k + 3*pairs] + b[k + 3*pairs] + 1) >> 1;
+    }
+}
+
+// One level of a pyramid being written
+struct PyramidLevel
+{
+    int width;
+    int height;
+    size_t row_bytes;           // scan line size including padding
+    OutputFile file;            // the level's file
+    vector<uint8_t> rows;       // scan lines made from the last band of the level above
+    vector<uint8_t> waiting;    // the last scan line of the level above's band, if its pair has not come yet
+    int next;                   // index in the file of the next scan line of the level above
+};
+
+bool write_pyramid(const string& input, const string& output, int min_size, vector<string>& files,
+                   size_t band_bytes)
+{
+    files.clear();
+    StageTimer timer("pyramid");
+    int in_fd = open(input.c_str(), O_RDONLY);
+    if (in_fd < 0)
+    {
+        return false;
+    }
+    unsigned char header[BMP_HEADER_BYTES];
+    struct stat in_status;
+    BmpInfo info;
+    if (!read_fully(in_fd, header, BMP_HEADER_BYTES) || fstat(in_fd, &in_status) != 0
+        || !parse_bmp_header(header, in_status.st_size, info)
+        || lseek(in_fd, info.start, SEEK_SET) != info.start)
+    {
+        close(in_fd);
+        return false;
+    }
+
+    // Every level's file is created up front with its header, and its scan lines are appended as they are made
+    string base = output.size() > 4 && output.compare(output.size() - 4, 4, ".bmp") == 0
+                  ? output.substr(0, output.size() - 4) : output;
+    vector<PyramidLevel> levels;
+    int width = info.width;
+    int height = info.height;
+    bool ok = true;
+    while (ok && (width > 1 || height > 1) && max((width + 1)/2, (height + 1)/2) >= max(min_size, 1))
+    {
+        size_t above_size = size_t(width) * Image::CHANNELS;
+        width = (width + 1)/2;
+        height = (height + 1)/2;
+        string name = base + "_" + to_string(levels.size() + 1) + ".bmp";
+        struct stat out_status;
+        OutputFile file{name, name, -1};
+        ok = !(stat(name.c_str(), &out_status) == 0 && out_status.st_dev == in_status.st_dev
+               && out_status.st_ino == in_status.st_ino) && open_output(name, file);
+        size_t scanline_size = size_t(width) * Image::CHANNELS;
+        levels.push_back(PyramidLevel{width, height, scanline_size + (4 - scanline_size % 4) % 4, file,
+                                      vector<uint8_t>(), vector<uint8_t>(above_size), 0});
+        unsigned char out_header[HEADERS_SIZE];
+        make_bmp_header(out_header, width, height);
+        ok = ok && write_fully(file.fd, out_header, HEADERS_SIZE);
+        files.push_back(name);
+        timer.add_written(HEADERS_SIZE + (unsigned long long)levels.back().row_bytes * height);
+    }
+
+    size_t in_row_bytes = info.row_bytes;
+    int band_rows = int(min<size_t>(info.height, max<size_t>(2, band_bytes / in_row_bytes)));
+    vector<uint8_t> band(in_row_bytes * band_rows);
+    vector<pair<const uint8_t*, const uint8_t*>> blocks;
+    for (int first = 0; first < info.height && ok && !levels.empty(); first = first + band_rows)
+    {
+        int count = min(band_rows, info.height - first);
+        ok = read_fully(in_fd, band.data(), in_row_bytes * count);
+        if (!ok)
+        {
+            break;
+        }
+        if (info.bytes_per_pixel != Image::CHANNELS)
+        {
+            parallel_bands(count, in_row_bytes, count, 1, [&](int begin, int rows, int) {
+                for (int r = begin; r < begin + rows; r++)
+                {
+                    uint8_t* row = band.data() + in_row_bytes * r;
+                    unpack_scanline(row, row, info.width, info.bytes_per_pixel);
+                }
+            });
+        }
+
+        // The band goes down the levels, each level's new scan lines making the next level's
+        const uint8_t* above = band.data();
+        size_t above_row_bytes = in_row_bytes;
+        int above_width = info.width;
+        int above_height = info.height;
+        for (size_t l = 0; l < levels.size() && ok && count > 0; l++)
+        {
+            // Scan lines pair from the top of the image, so with an odd number the first in the file is alone
+            PyramidLevel& level = levels[l];
+            int odd = above_height % 2;
+            const uint8_t* carried = nullptr;
+            blocks.clear();
+            for (int r = 0; r < count; r++)
+            {
+                const uint8_t* row = above + above_row_bytes * r;
+                int index = level.next + r;
+                if (odd == 1 && index == 0)
+                {
+                    blocks.push_back(make_pair(row, nullptr));
+                }
+                else if ((index - odd) % 2 == 1)
+                {
+                    blocks.push_back(make_pair(level.waiting.data(), row));
+                }
+                else if (r + 1 < count)
+                {
+                    blocks.push_back(make_pair(row, row + above_row_bytes));
+                    r++;
+                }
+                else
+                {
+                    carried = row;
+                }
+            }
+            level.next = level.next + count;
+
+            level.rows.resize(max(level.rows.size(), level.row_bytes * blocks.size()));
+            parallel_bands(blocks.size(), level.row_bytes, blocks.size(), 1, [&](int begin, int rows, int) {
+                for (int k = begin; k < begin + rows; k++)
+                {
+                    halve_rows(blocks[k].first, blocks[k].second, level.rows.data() + level.row_bytes * k,
+                               above_width);
+                }
+            });
+            if (carried != nullptr)
+            {
+                memcpy(level.waiting.data(), carried, level.waiting.size());
+            }
+            ok = blocks.empty() || write_fully(level.file.fd, level.rows.data(), level.row_bytes * blocks.size());
+
+            above = level.rows.data();
+            above_row_bytes = level.row_bytes;
+            above_width = level.width;
+            above_height = level.height;
+            count = blocks.size();
+        }
+    }
+
+    timer.add_read(info.start + (unsigned long long)in_row_bytes * info.height);
+    timer.add_pixels((unsigned long long)info.width * info.height);
+    close(in_fd);
+    // The levels are put in place only if every one of them was written
+    bool written = ok;
+    for (size_t l = 0; l < levels.size(); l++)
+    {
+        ok = close_output(levels[l].file, written) && ok;
+    }
+    return ok;
+}
+
+//***************************************************************************************************//
+//                                    SHARED MEMORY FRAMES                                           //
+//***************************************************************************************************//
+
+/**
+ * Gets the bytes per pixel of a frame layout
+ * @param format the layout
+ * @return 3 or 4, or 0 for an unknown layout
+ */
+int format_bytes(uint32_t format)
+{
+    return format == PIXEL_BGR24 ? Image::CHANNELS : format == PIXEL_BGRA32 ? 4 : 0;
+}
+
+/**
+ * Gives a segment name the leading slash shm_open() wants
+ * @param name the name
+ * @return the name starting with a slash
+ */
+string segment_name(const string& name)
+{
+    return !name.empty() && name[0] == '/' ? name : "/" + name;
+}
+
+SharedFrame::SharedFrame() : map_(nullptr), size_(0)
+{
+}
+
+SharedFrame::~SharedFrame()
+{
+    close();
+}
+
+bool SharedFrame::map(int fd, bool writable)
+{
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size < off_t(sizeof(SharedFrameHeader)))
+    {
+        ::close(fd);
+        return false;
+    }
+    void* map = mmap(nullptr, status.st_size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED)
+    {
+        return false;
+    }
+    map_ = static_cast<uint8_t*>(map);
+    size_ = status.st_size;
+    return true;
+}
+
+bool SharedFrame::valid() const
+{
+    const SharedFrameHeader& frame = header();
+    int64_t row_bytes = int64_t(frame.width) * format_bytes(frame.format);
+    return frame.magic == SHARED_FRAME_MAGIC && row_bytes > 0 && frame.height > 0 && frame.stride >= row_bytes
+        && frame.offset >= sizeof(SharedFrameHeader) && frame.offset <= size_
+        && uint64_t(frame.stride) * (frame.height - 1) + row_bytes <= size_ - frame.offset;
+}
+
+bool SharedFrame::open(const string& name, bool writable)
+{
+    close();
+    int fd = shm_open(segment_name(name).c_str(), writable ? O_RDWR : O_RDONLY, 0);
+    if (fd < 0 || !map(fd, writable))
+    {
+        return false;
+    }
+    if (!valid())
+    {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool SharedFrame::create(const string& name, int width, int height, PixelFormat format)
+{
+    close();
+    if (width <= 0 || height <= 0 || format_bytes(format) == 0)
+    {
+        return false;
+    }
+    int64_t row_bytes = int64_t(width) * format_bytes(format);
+    int64_t stride = (row_bytes + Image::DEFAULT_ALIGNMENT - 1) / Image::DEFAULT_ALIGNMENT * Image::DEFAULT_ALIGNMENT;
+    off_t needed = SHARED_FRAME_PIXEL_OFFSET + stride * height;
+    int fd = shm_open(segment_name(name).c_str(), O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+    {
+        return false;
+    }
+    // A segment is only ever grown, since shrinking it under another process's mapping would fault there
+    struct stat status;
+    if (fstat(fd, &status) != 0 || (status.st_size < needed && ftruncate(fd, needed) != 0))
+    {
+        ::close(fd);
+        return false;
+    }
+    if (!map(fd, true))
+    {
+        return false;
+    }
+    SharedFrameHeader& frame = *reinterpret_cast<SharedFrameHeader*>(map_);
+    frame.magic = SHARED_FRAME_MAGIC;
+    frame.offset = SHARED_FRAME_PIXEL_OFFSET;
+    return reshape(width, height, format);
+}
+
+bool SharedFrame::reshape(int width, int height, PixelFormat format)
+{
+    SharedFrameHeader& frame = *reinterpret_cast<SharedFrameHeader*>(map_);
+    int64_t row_bytes = int64_t(width) * format_bytes(format);
+    int64_t stride = (row_bytes + Image::DEFAULT_ALIGNMENT - 1) / Image::DEFAULT_ALIGNMENT * Image::DEFAULT_ALIGNMENT;
+    if (frame.offset + uint64_t(stride) * height > size_)
+    {
+        // Rows padded for alignment may not fit where packed ones do, as when a frame is turned in place
+        stride = row_bytes;
+    }
+    if (row_bytes <= 0 || height <= 0 || frame.offset + uint64_t(stride) * height > size_)
+    {
+        return false;
+    }
+    frame.format = format;
+    frame.width = width;
+    frame.height = height;
+    frame.stride = stride;
+    return true;
+}
+
+void SharedFrame::close()
+{
+    if (map_ != nullptr)
+    {
+        munmap(map_, size_);
+    }
+    map_ = nullptr;
+    size_ = 0;
+}
+
+bool SharedFrame::remove(const string& name)
+{
+    return shm_unlink(segment_name(name).c_str()) == 0;
+}
+
+ImageView SharedFrame::view() const
+{
+    if (!is_open() || header().format != PIXEL_BGR24)
+    {
+        return ImageView();
+    }
+    return ImageView(pixels(), header().width, header().height, header().stride);
+}
+
+bool run_shared(const string& input, const string& output, const vector<Operation>& ops)
+{
+    bool in_place = segment_name(input) == segment_name(output);
+    SharedFrame source;
+    if (!source.open(input, in_place))
+    {
+        return false;
+    }
+    SharedFrameHeader frame = source.header();
+    bool all_point = true;
+    for (size_t k = 0; k < ops.size(); k++)
+    {
+        all_point = all_point && is_point_process(ops[k].process);
+    }
+
+    // Per-pixel chains run straight from the input pixels to the output pixels
+    SharedFrame created;
+    SharedFrame& target = in_place ? source : created;
+    if (all_point && frame.format == PIXEL_BGR24)
+    {
+        if (!in_place && !target.create(output, frame.width, frame.height, PIXEL_BGR24))
+        {
+            return false;
+        }
+        apply_point_ops(source.view(), ops, target.pixels(), target.header().stride);
+        return true;
+    }
+
+    // Anything else makes its result from a view of the input, unpacked first if it has a fourth byte
+    Image unpacked;
+    ImageView image = source.view();
+    if (frame.format != PIXEL_BGR24)
+    {
+        unpacked = Image::uninitialized(frame.width, frame.height);
+        for (int i = 0; i < frame.height; i++)
+        {
+            unpack_scanline(source.pixels() + frame.stride * i, unpacked.row(i), frame.width,
+                            format_bytes(frame.format));
+        }
+        image = unpacked;
+    }
+    Image result = run_operations(image, ops);
+    bool ready = in_place ? target.reshape(result.width(), result.height(), PIXEL_BGR24)
+                          : target.create(output, result.width(), result.height(), PIXEL_BGR24);
+    if (!ready)
+    {
+        return false;
+    }
+    for (int i = 0; i < result.height(); i++)
+    {
+        memcpy(target.pixels() + target.header().stride * i, result.row(i), size_t(result.width()) * Image::CHANNELS);
+    }
+    return true;
+}
+
+//***************************************************************************************************//
+//                                    BATCH JOBS                                                     //
+//***************************************************************************************************//
+
+/**
+ * Splits a line into words separated by spaces or tabs
+ * @param line the line
+ * @return the words
+ */
+vector<string> split_words(const string& line)
+{
+    vector<string> words;
+    size_t begin = line.find_first_not_of(" \t\r");
+    while (begin != string::npos)
+    {
+        size_t end = line.find_first_of(" \t\r", begin);
+        words.push_back(line.substr(begin, end == string::npos ? string::npos : end - begin));
+        begin = end == string::npos ? end : line.find_first_not_of(" \t\r", end);
+    }
+    return words;
+}
+
+/**
+ * Parses the processes of a job. A job that names an unknown process gets
+ * an error instead, so it fails without stopping the rest of the batch.
+ * @param job   the job
+ * @param words the processes, as given on the command line
+ * @return nothing
+ */
+void parse_job_operations(BatchJob& job, const vector<string>& words)
+{
+    for (size_t k = 0; k < words.size() && job.error.empty(); k++)
+    {
+        Operation op;
+        if (!parse_operation(words[k], op))
+        {
+            job.error = "unknown process " + words[k];
+        }
+        job.ops.push_back(op);
+    }
+    if (words.empty() && job.error.empty())
+    {
+        job.error = "no processes";
+    }
+}
+
+bool read_manifest(const string& filename, vector<BatchJob>& jobs)
+{
+    ifstream manifest(filename);
+    if (!manifest)
+    {
+        return false;
+    }
+    string line;
+    int number = 0;
+    while (getline(manifest, line))
+    {
+        number++;
+        vector<string> words = split_words(line);
+        if (words.empty() || words[0][0] == '#')
+        {
+            continue;
+        }
+        BatchJob job;
+        job.input = words[0];
+        if (words.size() < 2)
+        {
+            job.error = "line " + to_string(number) + " has no output file";
+        }
+        else
+        {
+            job.output = words[1];
+            parse_job_operations(job, vector<string>(words.begin() + 2, words.end()));
+        }
+        jobs.push_back(job);
+    }
+    return true;
+}
+
+void glob_jobs(const string& pattern, const string& output_dir, const vector<string>& words,
+               vector<BatchJob>& jobs)
+{
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0)
+    {
+        for (size_t k = 0; k < matches.gl_pathc; k++)
+        {
+            string input = matches.gl_pathv[k];
+            size_t slash = input.find_last_of('/');
+            BatchJob job;
+            job.input = input;
+            job.output = output_dir + "/" + (slash == string::npos ? input : input.substr(slash + 1));
+            parse_job_operations(job, words);
+            jobs.push_back(job);
+        }
+    }
+    globfree(&matches);
+}
+
+int run_batch(vector<BatchJob>& jobs, size_t band_bytes)
+{
+    atomic<int> failed{0};
+    thread_pool().parallel_for(int(jobs.size()), [&](int k, int) {
+        BatchJob& job = jobs[k];
+        JobScope measured(job.input);
+        auto begin = chrono::steady_clock::now();
+        if (job.error.empty() && !run_pipeline(job.input, job.output, job.ops, band_bytes))
+        {
+            job.error = "could not process " + job.input;
+        }
+        job.seconds = chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+        if (!job.error.empty())
+        {
+            failed++;
+        }
+    });
+    return failed;
+}
+
+//***************************************************************************************************//
+//                                    JOB SERVER                                                     //
+//***************************************************************************************************//
+
+// Longest request line accepted, which is plenty for two paths and a chain of processes
+const size_t MAX_REQUEST_BYTES = 64 << 10;
+
+/**
+ * Reads one line from a socket, without the newline. Reads a byte at a
+ * time so none of the inline bytes that may follow the line are taken.
+ * Helper function for serve()
+ * @param fd   the socket
+ * @param line receives the line
+ * @return True if a whole line was read and false at the end of the connection
+ */
+bool read_line(int fd, string& line)
+{
+    line.clear();
+    while (line.size() < MAX_REQUEST_BYTES)
+    {
+        char c;
+        ssize_t got = read(fd, &c, 1);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            return false;
+        }
+        if (c == '\n')
+        {
+            return true;
+        }
+        line += c;
+    }
+    return false;
+}
+
+/**
+ * Formats milliseconds for a reply
+ * @param seconds the time in seconds
+ * @return the time in milliseconds with one decimal
+ */
+string milliseconds(double seconds)
+{
+    ostringstream out;
+    out << fixed;
+    out.precision(1);
+    out << seconds * 1000;
+    return out.str();
+}
+
+/**
+ * The server behind serve(). Each connection is served by a thread of its
+ * own, which reads and answers requests one after another. Input files are
+ * opened through one ImageCache shared by every connection. The bands of
+ * each job go to the shared thread pool, so jobs from all the connections
+ * share its threads however many clients there are.
+ */
+class JobServer
+{
+public:
+    explicit JobServer(size_t max_inline_bytes) : listen_fd_(-1), max_inline_bytes_(max_inline_bytes), jobs_(0)
+    {
+    }
+
+    /**
+     * Listens on a socket and serves clients until one asks for a shutdown
+     * @param socket_path file name of the socket (replaced if one is there already)
+     * @return True after a shutdown and false if the socket could not be opened
+     */
+    bool run(const string& socket_path)
+    {
+        struct sockaddr_un address;
+        memset(&address, 0, sizeof(address));
+        address.sun_family = AF_UNIX;
+        if (socket_path.empty() || socket_path.size() >= sizeof(address.sun_path))
+        {
+            return false;
+        }
+        strcpy(address.sun_path, socket_path.c_str());
+
+        // Only a socket left behind by an earlier server is replaced, never another file
+        struct stat status;
+        if (lstat(socket_path.c_str(), &status) == 0 && S_ISSOCK(status.st_mode))
+        {
+            unlink(socket_path.c_str());
+        }
+        listen_fd_ = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listen_fd_ < 0 || ::bind(listen_fd_, (struct sockaddr*)&address, sizeof(address)) != 0
+            || listen(listen_fd_, 64) != 0)
+        {
+            if (listen_fd_ >= 0)
+            {
+                close(listen_fd_);
+            }
+            return false;
+        }
+        // A client that hangs up early must not take the server down with it
+        signal(SIGPIPE, SIG_IGN);
+
+        while (true)
+        {
+            int fd = accept(listen_fd_, nullptr, nullptr);
+            if (fd < 0)
+            {
+                if (errno == EINTR || errno == ECONNABORTED)
+                {
+                    continue;
+                }
+                break;
+            }
+            lock_guard<mutex> guard(lock_);
+            connections_.insert(fd);
+            thread(&JobServer::serve_connection, this, fd).detach();
+        }
+
+        // Connections still open finish the request they are on, then see the end of their input
+        unique_lock<mutex> guard(lock_);
+        for (int fd : connections_)
+        {
+            ::shutdown(fd, SHUT_RD);
+        }
+        idle_.wait(guard, [&] { return connections_.empty(); });
+        close(listen_fd_);
+        unlink(socket_path.c_str());
+        return true;
+    }
+
+private:
+    void serve_connection(int fd)
+    {
+        string line;
+        bool open = true;
+        while (open && read_line(fd, line))
+        {
+            string reply;
+            vector<uint8_t> result;
+            // A request that fails, even for want of memory, costs only its own reply
+            try
+            {
+                open = handle(fd, split_words(line), reply, result);
+            }
+            catch (const exception& error)
+            {
+                result.clear();
+                reply = string("error the request failed: ") + error.what() + "\n";
+            }
+            bool sent = write_fully(fd, reply.data(), reply.size());
+            if (sent && !result.empty())
+            {
+                string count = to_string(result.size()) + "\n";
+                sent = write_fully(fd, count.data(), count.size()) && write_fully(fd, result.data(), result.size());
+            }
+            open = open && sent;
+        }
+        lock_guard<mutex> guard(lock_);
+        close(fd);
+        connections_.erase(fd);
+        idle_.notify_all();
+    }
+
+    /**
+     * Runs one request
+     * @param fd     the socket, for reading inline input
+     * @param words  the request
+     * @param reply  receives the reply line
+     * @param result receives the bytes of the result, when they go back inline
+     * @return True to go on reading requests and false to close the connection
+     */
+    bool handle(int fd, const vector<string>& words, string& reply, vector<uint8_t>& result)
+    {
+        if (words.size() == 1 && words[0] == "shutdown")
+        {
+            reply = "ok shutting down\n";
+            ::shutdown(listen_fd_, SHUT_RDWR);
+            return false;
+        }
+        if (words.size() == 1 && words[0] == "stats")
+        {
+            lock_guard<mutex> guard(cache_lock_);
+            reply = "ok jobs=" + to_string(jobs_) + " cache_hits=" + to_string(cache_.hits()) + " cache_misses="
+                    + to_string(cache_.misses()) + " cache_mb=" + to_string(cache_.used_bytes() >> 20)
+                    + " threads=" + to_string(thread_count()) + "\n";
+            return true;
+        }
+        if (words.size() < 2)
+        {
+            reply = "error expected INPUT OUTPUT PROCESS...\n";
+            return !words.empty();
+        }
+
+        BatchJob job;
+        job.input = words[0];
+        job.output = words[1];
+        JobScope measured("serve " + job.input);
+        auto begin = chrono::steady_clock::now();
+
+        // Inline bytes are read before anything else, so a bad request leaves the connection in step
+        vector<uint8_t> bytes;
+        string count;
+        if (job.input == "-")
+        {
+            char* end = nullptr;
+            unsigned long long size = read_line(fd, count) ? strtoull(count.c_str(), &end, 10) : 0;
+            if (end == nullptr || *end != '\0' || count.empty())
+            {
+                reply = "error expected a byte count after the request\n";
+                return false;
+            }
+            // The bytes are not read when they are refused, so the connection is closed
+            if (size > max_inline_bytes_)
+            {
+                reply = "error the input is larger than the limit of " + to_string(max_inline_bytes_) + " bytes\n";
+                return false;
+            }
+            try
+            {
+                bytes.resize(size);
+            }
+            catch (const bad_alloc&)
+            {
+                reply = "error not enough memory for the input bytes\n";
+                return false;
+            }
+            if (!read_fully(fd, bytes.data(), bytes.size()))
+            {
+                reply = "error connection closed before all input bytes arrived\n";
+                return false;
+            }
+        }
+        parse_job_operations(job, vector<string>(words.begin() + 2, words.end()));
+        if (!job.error.empty())
+        {
+            reply = "error " + job.error + "\n";
+            return true;
+        }
+        struct stat in_status;
+        struct stat out_status;
+        if (job.input != "-" && (job.input == job.output
+            || (stat(job.input.c_str(), &in_status) == 0 && stat(job.output.c_str(), &out_status) == 0
+                && in_status.st_dev == out_status.st_dev && in_status.st_ino == out_status.st_ino)))
+        {
+            reply = "error the output file cannot be the same as the input file\n";
+            return true;
+        }
+
+        Image decoded;
+        shared_ptr<const ImageView> opened;
+        ImageView input;
+        if (job.input == "-")
+        {
+            decode_bmp(bytes.data(), bytes.size(), decoded);
+            input = decoded;
+        }
+        else
+        {
+            lock_guard<mutex> guard(cache_lock_);
+            opened = cache_.open(job.input);
+            input = opened ? *opened : ImageView();
+        }
+        auto read = chrono::steady_clock::now();
+        if (input.empty())
+        {
+            reply = "error " + (job.input == "-" ? string("the input bytes are") : job.input + " is")
+                    + " not a valid BMP image\n";
+            return true;
+        }
+
+        Image output = run_operations(input, job.ops);
+        auto processed = chrono::steady_clock::now();
+        if (output.empty())
+        {
+            reply = "error the processes leave an image with no pixels or too many\n";
+            return true;
+        }
+        bool ok = job.output == "-" ? encode_bmp(output, result) : write_image(job.output, output);
+        auto written = chrono::steady_clock::now();
+        if (!ok)
+        {
+            result.clear();
+            reply = "error could not write " + job.output + "\n";
+            return true;
+        }
+
+        jobs_++;
+        reply = "ok wall_ms=" + milliseconds(chrono::duration<double>(written - begin).count())
+                + " read_ms=" + milliseconds(chrono::duration<double>(read - begin).count())
+                + " process_ms=" + milliseconds(chrono::duration<double>(processed - read).count())
+                + " write_ms=" + milliseconds(chrono::duration<double>(written - processed).count()) + "\n";
+        return true;
+    }
+
+    int listen_fd_;
+    size_t max_inline_bytes_;
+    mutex lock_;
+    condition_variable idle_;
+    set<int> connections_;      // sockets of the clients connected
+    atomic<long long> jobs_;
+    mutex cache_lock_;
+    ImageCache cache_;
+};
+
+bool serve(const string& socket_path, size_t max_inline_bytes)
+{
+    JobServer server(max_inline_bytes);
+    return server.run(socket_path);
+}
+
+} // namespace imageprocessor
@@ -0,0 +1,1098 @@
+/*
+imageprocessor.h
+CSPB 1300 Image Processing Application
+
+The image processing engine as a library: the BMP reader and writer, the ten
+processes and chains of them, working on images in memory. Everything is in
+the imageprocessor namespace. Link against imageprocessor.cpp (see README.md).
+*/
+
+#ifndef IMAGEPROCESSOR_H
+#define IMAGEPROCESSOR_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Version of the API in this header. The minor version goes up when
+// something is added; the major version only when something here changes.
+#define IMAGEPROCESSOR_VERSION_MAJOR 1
+#define IMAGEPROCESSOR_VERSION_MINOR 7
+
+namespace imageprocessor
+{
+
+/**
+ * Gets the version of the API the library was built with, as
+ * 100 * IMAGEPROCESSOR_VERSION_MAJOR + IMAGEPROCESSOR_VERSION_MINOR, so a
+ * program can check it was linked against the library its header came from
+ * @return the version
+ */
+int api_version();
+
+//***************************************************************************************************//
+//                                    PACKED IMAGE BUFFER                                            //
+//***************************************************************************************************//
+
+/**
+ * A read-only view of pixels laid out like an Image (packed blue, green, red
+ * channels, rows from top to bottom) in memory owned by someone else, such as
+ * a memory-mapped BMP file. The stride may be negative, which is how a
+ * bottom-up pixel array is walked from the top row down.
+ */
+class ImageView
+{
+public:
+    ImageView() : data_(nullptr), width_(0), height_(0), stride_(0)
+    {
+    }
+
+    /**
+     * Creates a view of existing pixels
+     * @param data   first byte of the top row
+     * @param width  width in pixels
+     * @param height height in pixels
+     * @param stride distance in bytes from one row to the next one down
+     */
+    ImageView(const uint8_t* data, int width, int height, ptrdiff_t stride)
+        : data_(data), width_(width), height_(height), stride_(stride)
+    {
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    ptrdiff_t stride() const { return stride_; }
+    bool empty() const { return width_ <= 0 || height_ <= 0; }
+
+    const uint8_t* row(int i) const { return data_ + stride_ * i; }
+
+private:
+    const uint8_t* data_;
+    int width_;
+    int height_;
+    ptrdiff_t stride_;
+};
+
+/**
+ * Counts a buffer handed out by the pool against the job measured on the
+ * calling thread, if any. Called by BufferPool::acquire().
+ * @param reused True if the buffer was recycled and false if newly allocated
+ * @return nothing
+ */
+void count_buffer(bool reused);
+
+/**
+ * Recycles image buffers, so a steady stream of images of similar sizes
+ * stops allocating and page-faulting fresh memory for every result. Requests
+ * are rounded up to a size class (at most an eighth over, and whole pages),
+ * and a buffer given back waits on its class's free list for the next
+ * request of that class, as long as the pool is not already holding more
+ * than its limit.
+ */
+class BufferPool
+{
+public:
+    // Free memory held for reuse unless set otherwise
+    static const size_t DEFAULT_MAX_RETAINED = size_t(512) << 20;
+
+    explicit BufferPool(size_t max_retained = DEFAULT_MAX_RETAINED)
+        : max_retained_(max_retained), retained_(0), reused_(0), allocated_(0)
+    {
+    }
+
+    ~BufferPool()
+    {
+        trim();
+    }
+
+    BufferPool(const BufferPool&) = delete;
+    BufferPool& operator=(const BufferPool&) = delete;
+
+    /**
+     * Works out the size class a request falls in. Throws std::bad_alloc for
+     * a request too big to round up to any class.
+     * @param bytes size asked for
+     * @return the size of the buffers of that class
+     */
+    static size_t size_class(size_t bytes)
+    {
+        size_t granularity = 4096;
+        while (bytes > 0 && granularity <= (bytes - 1) / 8)
+        {
+            granularity = granularity * 2;
+        }
+        if (bytes > SIZE_MAX - (granularity - 1))
+        {
+            throw std::bad_alloc();
+        }
+        return (bytes + granularity - 1) / granularity * granularity;
+    }
+
+    /**
+     * Hands out a buffer, recycled if one of the right class is free
+     * @param bytes     size needed
+     * @param alignment alignment needed (a power of two)
+     * @param capacity  receives the real size of the buffer, to give back with it
+     * @return the buffer
+     */
+    uint8_t* acquire(size_t bytes, size_t alignment, size_t& capacity)
+    {
+        capacity = size_class(std::max<size_t>(bytes, 1));
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            std::vector<uint8_t*>& free_list = free_[std::make_pair(capacity, alignment)];
+            if (!free_list.empty())
+            {
+                uint8_t* memory = free_list.back();
+                free_list.pop_back();
+                retained_ = retained_ - capacity;
+                reused_++;
+                count_buffer(true);
+                return memory;
+            }
+            allocated_++;
+            count_buffer(false);
+        }
+        void* memory = std::aligned_alloc(std::max<size_t>(alignment, sizeof(void*)), capacity);
+        if (memory == nullptr)
+        {
+            throw std::bad_alloc();
+        }
+        return static_cast<uint8_t*>(memory);
+    }
+
+    /**
+     * Gives a buffer back for reuse, or frees it if the pool is full
+     * @param memory    the buffer
+     * @param capacity  its size, as acquire() gave it
+     * @param alignment its alignment, as asked of acquire()
+     * @return nothing
+     */
+    void release(uint8_t* memory, size_t capacity, size_t alignment)
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock_);
+            if (retained_ + capacity <= max_retained_)
+            {
+                free_[std::make_pair(capacity, alignment)].push_back(memory);
+                retained_ = retained_ + capacity;
+                return;
+            }
+        }
+        std::free(memory);
+    }
+
+    /**
+     * Frees every buffer waiting for reuse
+     * @return nothing
+     */
+    void trim()
+    {
+        std::lock_guard<std::mutex> guard(lock_);
+        for (auto& entry : free_)
+        {
+            for (size_t k = 0; k < entry.second.size(); k++)
+            {
+                std::free(entry.second[k]);
+            }
+        }
+        free_.clear();
+        retained_ = 0;
+    }
+
+    size_t retained_bytes() const { std::lock_guard<std::mutex> guard(lock_); return retained_; }
+    size_t reused() const { std::lock_guard<std::mutex> guard(lock_); return reused_; }
+    size_t allocated() const { std::lock_guard<std::mutex> guard(lock_); return allocated_; }
+
+private:
+    mutable std::mutex lock_;
+    std::map<std::pair<size_t, size_t>, std::vector<uint8_t*>> free_;     // by size class and alignment
+    size_t max_retained_;
+    size_t retained_;
+    size_t reused_;
+    size_t allocated_;
+};
+
+/**
+ * Gets the pool every image buffer comes from. It is never destroyed, so
+ * images in static storage can still give their buffers back at exit.
+ * @return the pool
+ */
+BufferPool& buffer_pool();
+
+/**
+ * An image held in one contiguous, row-strided buffer of 8-bit channels.
+ * Pixels are packed in blue, green, red order (the order BMP files use) and
+ * rows run from top to bottom, the same as the vector of vector of Pixels.
+ * Every row starts stride() bytes after the previous one, where the stride is
+ * the packed row size rounded up to the row alignment. Buffers come from
+ * buffer_pool() and go back to it when the image is destroyed.
+ */
+class Image
+{
+public:
+    // Channel offsets inside a packed pixel
+    static const int BLUE = 0;
+    static const int GREEN = 1;
+    static const int RED = 2;
+    static const int CHANNELS = 3;
+
+    // Rows start on cache line boundaries unless asked otherwise
+    static const size_t DEFAULT_ALIGNMENT = 64;
+
+    /**
+     * Creates an empty image
+     */
+    Image() : width_(0), height_(0), stride_(0), alignment_(DEFAULT_ALIGNMENT)
+    {
+    }
+
+    /**
+     * Creates an image of the given size with all channels set to zero
+     * @param width     width in pixels
+     * @param height    height in pixels
+     * @param alignment row alignment in bytes (a power of two)
+     */
+    Image(int width, int height, size_t alignment = DEFAULT_ALIGNMENT)
+        : Image(width, height, alignment, true)
+    {
+    }
+
+    /**
+     * Creates an image of the given size without clearing it, for callers
+     * such as decoders that overwrite every pixel anyway
+     * @param width  width in pixels
+     * @param height height in pixels
+     * @return the image
+     */
+    static Image uninitialized(int width, int height)
+    {
+        return Image(width, height, DEFAULT_ALIGNMENT, false);
+    }
+
+    Image(const Image& other) : Image(other.width_, other.height_, other.alignment_, false)
+    {
+        if (!empty())
+        {
+            std::memcpy(buffer_.get(), other.buffer_.get(), stride_ * height_);
+        }
+    }
+
+    /**
+     * Creates an image holding a copy of the pixels in a view
+     * @param view the pixels to copy
+     */
+    explicit Image(const ImageView& view) : Image(view.width(), view.height(), DEFAULT_ALIGNMENT, false)
+    {
+        for (int i = 0; i < height_; i++)
+        {
+            std::memcpy(row(i), view.row(i), size_t(width_) * CHANNELS);
+        }
+    }
+
+    Image(Image&& other) noexcept
+        : width_(other.width_), height_(other.height_), stride_(other.stride_),
+          alignment_(other.alignment_), buffer_(std::move(other.buffer_))
+    {
+        other.width_ = 0;
+        other.height_ = 0;
+        other.stride_ = 0;
+    }
+
+    Image& operator=(const Image& other)
+    {
+        if (this != &other)
+        {
+            *this = Image(other);
+        }
+        return *this;
+    }
+
+    Image& operator=(Image&& other) noexcept
+    {
+        width_ = other.width_;
+        height_ = other.height_;
+        stride_ = other.stride_;
+        alignment_ = other.alignment_;
+        buffer_ = std::move(other.buffer_);
+        other.width_ = 0;
+        other.height_ = 0;
+        other.stride_ = 0;
+        return *this;
+    }
+
+    int width() const { return width_; }
+    int height() const { return height_; }
+    size_t stride() const { return stride_; }
+    size_t alignment() const { return alignment_; }
+    bool empty() const { return width_ == 0 || height_ == 0; }
+
+    // Number of bytes in the buffer, including the row padding
+    size_t size_bytes() const { return stride_ * height_; }
+
+    // Number of bytes the buffer could hold, which may be more than the image uses
+    size_t capacity() const { return buffer_ ? buffer_.get_deleter().capacity : 0; }
+
+    /**
+     * Changes the size of the image without clearing it, keeping the buffer
+     * if it is big enough, so an image can be handed to a process again and
+     * again as its output
+     * @param width  width in pixels
+     * @param height height in pixels
+     * @return nothing
+     */
+    void resize_uninitialized(int width, int height)
+    {
+        size_t row_bytes = size_t(std::max(width, 0)) * CHANNELS;
+        size_t stride = (row_bytes + alignment_ - 1) / alignment_ * alignment_;
+        if (width > 0 && height > 0 && stride * height <= capacity())
+        {
+            width_ = width;
+            height_ = height;
+            stride_ = stride;
+        }
+        else
+        {
+            *this = Image(width, height, alignment_, false);
+        }
+    }
+
+    uint8_t* data() { return buffer_.get(); }
+    const uint8_t* data() const { return buffer_.get(); }
+
+    uint8_t* row(int i) { return buffer_.get() + stride_ * i; }
+    const uint8_t* row(int i) const { return buffer_.get() + stride_ * i; }
+
+    // Read-only view of the whole image, which is what the processes take
+    ImageView view() const { return ImageView(buffer_.get(), width_, height_, stride_); }
+    operator ImageView() const { return view(); }
+
+private:
+    Image(int width, int height, size_t alignment, bool zero_fill)
+        : width_(0), height_(0), stride_(0), alignment_(alignment)
+    {
+        if (width <= 0 || height <= 0)
+        {
+            return;
+        }
+        width_ = width;
+        height_ = height;
+        size_t row_bytes = size_t(width) * CHANNELS;
+        stride_ = (row_bytes + alignment - 1) / alignment * alignment;
+        size_t capacity;
+        uint8_t* memory = buffer_pool().acquire(stride_ * height_, alignment, capacity);
+        if (zero_fill)
+        {
+            std::memset(memory, 0, stride_ * height_);
+        }
+        buffer_ = std::unique_ptr<uint8_t, PoolDeleter>(memory, PoolDeleter{capacity, alignment});
+    }
+
+    struct PoolDeleter
+    {
+        PoolDeleter() : capacity(0), alignment(0) {}
+        PoolDeleter(size_t capacity, size_t alignment) : capacity(capacity), alignment(alignment) {}
+        size_t capacity;
+        size_t alignment;
+        void operator()(uint8_t* memory) const { buffer_pool().release(memory, capacity, alignment); }
+    };
+
+    int width_;
+    int height_;
+    size_t stride_;
+    size_t alignment_;
+    std::unique_ptr<uint8_t, PoolDeleter> buffer_;
+};
+
+//***************************************************************************************************//
+//                                    INSTRUMENTATION                                                //
+//***************************************************************************************************//
+
+/**
+ * Turns on instrumentation, exporting to a file in the format its name asks
+ * for: Prometheus text if it ends in .prom, JSON lines otherwise
+ * @param filename the file (overwritten)
+ * @return True if the file could be written and false otherwise
+ */
+bool enable_metrics(const std::string& filename);
+
+struct JobMetrics;
+
+/**
+ * Measures a job from construction to destruction and exports it, unless
+ * it did nothing (quitting the menu, say). Stages timed on the same thread
+ * in between are counted in it. CPU time and image buffers are counted per
+ * thread, for the job that thread works for: pool tasks count for the job
+ * that started them, so jobs running at the same time are measured apart.
+ * Peak RSS is the whole process's high-water mark when the job ends.
+ */
+class JobScope
+{
+public:
+    explicit JobScope(const std::string& job);
+    ~JobScope();
+
+    JobScope(const JobScope&) = delete;
+    JobScope& operator=(const JobScope&) = delete;
+
+private:
+    std::unique_ptr<JobMetrics> job_;
+    JobMetrics* previous_;
+    double wall_start_ = 0;
+};
+
+//***************************************************************************************************//
+//                                    BMP FILE INPUT AND OUTPUT                                      //
+//***************************************************************************************************//
+
+/**
+ * Reads the BMP image specified into a packed image.
+ * The headers are validated up front, then the pixel array is read in large
+ * batches of scan lines. 24-bit scan lines are read straight into the rows of
+ * the image; 32-bit ones are staged and unpacked, dropping the alpha channel.
+ * @param filename BMP image filename
+ * @param image    receives the image, or an empty image on failure
+ * @return True if successful and false otherwise
+ */
+bool read_image(const std::string& filename, Image& image);
+
+/**
+ * Write a packed image to a BMP file name specified.
+ * The rows of the image already hold the scan lines in blue, green, red
+ * order, so they are gathered straight from the image with writev(), a batch
+ * of scan lines at a time, with the headers sent in the first call. An
+ * existing regular file is replaced by renaming a finished temporary file in
+ * the same directory over it, so mappings of the old file are left intact.
+ * @param filename The BMP file name to save the image to
+ * @param image    The input image to save
+ * @return True if successful and false otherwise
+ */
+bool write_image(const std::string& filename, const Image& image);
+
+/**
+ * Decodes a BMP file held in memory, such as one received over a socket,
+ * making the same checks read_image() makes of a file
+ * @param data  the bytes of the file
+ * @param size  the number of bytes
+ * @param image receives the image, or an empty image on failure
+ * @return True if the bytes are a valid 24- or 32-bit BMP image and false otherwise
+ */
+bool decode_bmp(const uint8_t* data, size_t size, Image& image);
+
+/**
+ * Encodes an image as a 24-bit BMP file in memory, byte for byte what
+ * write_image() would write
+ * @param image the image
+ * @param bmp   receives the bytes of the file
+ * @return True if successful and false if the image is empty
+ */
+bool encode_bmp(const ImageView& image, std::vector<uint8_t>& bmp);
+
+/**
+ * Works out the size of the 24-bit BMP file of an image
+ * @param width  width in pixels
+ * @param height height in pixels
+ * @return the size in bytes, headers and scan line padding included
+ */
+size_t bmp_file_size(int width, int height);
+
+// Default memory budget of an ImageCache
+const size_t DEFAULT_IMAGE_CACHE_BYTES = size_t(1) << 30;
+
+/**
+ * Keeps the input images opened most recently, so choosing another process
+ * for the same file skips opening and decoding it again. An entry is only
+ * used while the file's path, inode, size and modification time all still
+ * match, so a file rewritten in between is read afresh. The least recently
+ * used images are dropped to stay within a memory budget, counting the
+ * pixel data of each.
+ */
+class ImageCache
+{
+public:
+    explicit ImageCache(size_t budget_bytes = DEFAULT_IMAGE_CACHE_BYTES);
+    ~ImageCache();
+
+    ImageCache(const ImageCache&) = delete;
+    ImageCache& operator=(const ImageCache&) = delete;
+
+    /**
+     * Opens a BMP file through the cache. 24-bit files are viewed in place
+     * through a mapping of the file; others are decoded into a copy.
+     * @param filename BMP image filename
+     * @return the image, which stays valid while the pointer is held, or null
+     *         if the file is not a valid BMP image
+     */
+    std::shared_ptr<const ImageView> open(const std::string& filename);
+
+    size_t used_bytes() const;
+    size_t hits() const;
+    size_t misses() const;
+
+private:
+    struct State;
+    std::unique_ptr<State> state_;
+};
+
+//***************************************************************************************************//
+//                                    THREADS AND INSTRUCTION SETS                                   //
+//***************************************************************************************************//
+
+// Work done by a pool since it started, for working out how well it kept its threads busy
+struct SchedulerStats
+{
+    double busy_seconds = 0;    // time threads spent on tasks, not counting waits for other tasks
+    long long tasks = 0;        // tasks run
+    long long steals = 0;       // tasks run by a thread other than the one that made them
+};
+
+/**
+ * Works out how many threads to process images with: the IMAGEPROCESSOR_THREADS
+ * environment variable if it is set, otherwise one per hardware thread
+ * @return the number of threads
+ */
+int default_thread_count();
+
+/**
+ * Sets the number of threads images are processed with. Not to be called
+ * while images are being processed.
+ * @param threads number of threads (at least 1)
+ * @return nothing
+ */
+void set_thread_count(int threads);
+
+/**
+ * Gets the number of threads images are processed with, starting them the first time
+ * @return the number of threads
+ */
+int thread_count();
+
+/**
+ * Gets the work the threads have done since they started
+ * @return the totals
+ */
+SchedulerStats scheduler_stats();
+
+// Instruction sets the grayscale, high contrast and black, white, red, green,
+// blue kernels are built for, from slowest to fastest
+enum SimdLevel
+{
+    SIMD_SCALAR,
+    SIMD_SSE41,
+    SIMD_AVX2,
+    SIMD_AVX512
+};
+
+/**
+ * Chooses the instruction set the row kernels use. Asking for more than the
+ * CPU supports gives the best it does support. Not to be called while
+ * images are being processed.
+ * @param level the instruction set wanted
+ * @return the instruction set chosen
+ */
+SimdLevel set_simd_level(SimdLevel level);
+
+/**
+ * Gets the instruction set the row kernels use: the best the CPU supports,
+ * unless the IMAGEPROCESSOR_SIMD environment variable or set_simd_level()
+ * asks for less
+ * @return the instruction set
+ */
+SimdLevel simd_level();
+
+/**
+ * Names an instruction set the way IMAGEPROCESSOR_SIMD does
+ * @param level the instruction set
+ * @return "scalar", "sse4.1", "avx2" or "avx512"
+ */
+const char* simd_level_name(SimdLevel level);
+
+//***************************************************************************************************//
+//                                    FIXED POINT ARITHMETIC                                         //
+//***************************************************************************************************//
+
+// Fraction bits of the fixed-point scaling factors: a factor f is held as the
+// integer nearest f * 2^16, and a channel is scaled by an integer multiply and shift
+const int FIXED_POINT_BITS = 16;
+
+// How vignette, Clarendon, lighten and darken scale channel values
+enum FixedPoint
+{
+    FIXED_POINT_OFF,        // in double, truncating, as the processes always have
+    FIXED_POINT_TRUNCATE,   // in fixed point, truncating: the bytes the double arithmetic gives
+    FIXED_POINT_NEAREST     // in fixed point, rounding to the nearest value instead
+};
+
+/**
+ * Chooses how the tone and vignette arithmetic is done. Not to be called
+ * while images are being processed.
+ * @param mode the arithmetic wanted
+ * @return the arithmetic chosen
+ */
+FixedPoint set_fixed_point(FixedPoint mode);
+
+/**
+ * Gets how the tone and vignette arithmetic is done: in double unless the
+ * IMAGEPROCESSOR_FIXED_POINT environment variable or set_fixed_point() says otherwise
+ * @return the arithmetic
+ */
+FixedPoint fixed_point();
+
+/**
+ * Names an arithmetic the way IMAGEPROCESSOR_FIXED_POINT does
+ * @param mode the arithmetic
+ * @return "off", "truncate" or "nearest"
+ */
+const char* fixed_point_name(FixedPoint mode);
+
+/**
+ * What comparing fixed-point scaling with the double arithmetic found
+ */
+struct FixedPointCheck
+{
+    unsigned long long values = 0;      // channel values compared
+    unsigned long long mismatches = 0;  // values that came out differently
+    double factor = 0;                  // the first mismatch: its scaling factor,
+    int value = 0;                      // the channel value,
+    int expected = 0;                   // the byte the double arithmetic gives
+    int actual = 0;                     // and the byte the fixed-point arithmetic gives
+};
+
+/**
+ * Compares fixed-point Clarendon, lighten or darken with the double
+ * arithmetic for every channel value, 0 to 255
+ * @param mode           the fixed-point arithmetic to check
+ * @param process        2, 8 or 9
+ * @param scaling_factor the scaling factor of the process
+ * @return the comparison
+ */
+FixedPointCheck check_fixed_point(FixedPoint mode, int process, double scaling_factor);
+
+/**
+ * Compares the fixed-point vignette with the double arithmetic for every
+ * channel value, 0 to 255, at every distance from the center in an image size
+ * @param mode   the fixed-point arithmetic to check
+ * @param width  width of the image
+ * @param height height of the image
+ * @return the comparison
+ */
+FixedPointCheck check_fixed_point_vignette(FixedPoint mode, int width, int height);
+
+//***************************************************************************************************//
+//                                    IMAGE PROCESSES                                                //
+//***************************************************************************************************//
+
+// Process number of downscale, which is not on the menu
+const int DOWNSCALE_PROCESS = 11;
+
+// How an enlargement fills in pixels: each output pixel copies the source
+// pixel it falls in, as process 6 always has, or blends the four source
+// pixels around its centre
+const int ENLARGE_NEAREST = 0;
+const int ENLARGE_BILINEAR = 1;
+
+/**
+ * One of the ten processes with its parameters, as chained on the command
+ * line, or a downscale
+ */
+struct Operation
+{
+    int process;                // menu number 1 to 10, or DOWNSCALE_PROCESS
+    double scaling_factor = 0;  // for processes 2, 8 and 9
+    int rotations = 0;          // number of 90 degree rotations for process 5
+    int xscale = 0;             // scale factors for process 6
+    int yscale = 0;
+    int width = 0;              // largest size of the result of a downscale
+    int height = 0;
+    double xfactor = 0;         // fractional scale factors for process 6, used instead of xscale and yscale if set
+    double yfactor = 0;
+    int filter = ENLARGE_NEAREST;   // how process 6 fills in pixels
+};
+
+/**
+ * Tells whether a process is a per-pixel process (vignette, Clarendon,
+ * grayscale, high contrast, lighten, darken or black, white, red, green,
+ * blue). These only look at one pixel and its row and column, so they can run
+ * a scan line at a time and several can be applied in one pass.
+ * @param process menu number
+ * @return True for processes 1, 2, 3, 7, 8, 9 and 10
+ */
+bool is_point_process(int process);
+
+// The ten processes, each making a new image from any view of pixels
+
+Image process_1(const ImageView& image);
+Image process_2(const ImageView& image, double scaling_factor);
+Image process_3(const ImageView& image);
+Image process_4(const ImageView& image);
+Image process_5(const ImageView& image, int number);
+Image process_6(const ImageView& image, int xscale, int yscale);
+Image process_7(const ImageView& image);
+Image process_8(const ImageView& image, double scaling_factor);
+Image process_9(const ImageView& image, double scaling_factor);
+Image process_10(const ImageView& image);
+
+// The processes again, writing into an image the caller provides, whose buffer
+// is reused when it is big enough. A per-pixel process may write over the
+// image it reads; a rotation or enlargement may not.
+
+void process_1(const ImageView& image, Image& output);
+void process_2(const ImageView& image, double scaling_factor, Image& output);
+void process_3(const ImageView& image, Image& output);
+void process_4(const ImageView& image, Image& output);
+void process_5(const ImageView& image, int number, Image& output);
+void process_6(const ImageView& image, int xscale, int yscale, Image& output);
+void process_7(const ImageView& image, Image& output);
+void process_8(const ImageView& image, double scaling_factor, Image& output);
+void process_9(const ImageView& image, double scaling_factor, Image& output);
+void process_10(const ImageView& image, Image& output);
+
+// The per-pixel processes in place, overwriting the image they are given
+
+void process_1_in_place(Image& image);
+void process_2_in_place(Image& image, double scaling_factor);
+void process_3_in_place(Image& image);
+void process_7_in_place(Image& image);
+void process_8_in_place(Image& image, double scaling_factor);
+void process_9_in_place(Image& image, double scaling_factor);
+void process_10_in_place(Image& image);
+
+/**
+ * Shrinks an image by area averaging. Each pixel of the result is the
+ * average of the part of the image it covers, with source pixels it only
+ * partly covers counted in proportion, rounded to the nearest value. Sizes
+ * need not divide the image's size.
+ * @param image  the input image
+ * @param width  width of the result, 1 to the image's width
+ * @param height height of the result, 1 to the image's height
+ * @return the new image
+ */
+Image downscale(const ImageView& image, int width, int height);
+void downscale(const ImageView& image, int width, int height, Image& output);
+
+/**
+ * Works out the size of a downscale: the largest that fits in width by
+ * height with the image's aspect ratio, but never bigger than the image
+ * @param image_width  width of the image
+ * @param image_height height of the image
+ * @param width        largest width of the result
+ * @param height       largest height of the result
+ * @param new_width    receives the width of the result
+ * @param new_height   receives the height of the result
+ * @return nothing
+ */
+void downscale_size(int image_width, int image_height, int width, int height, int& new_width, int& new_height);
+
+/**
+ * Enlarges an image by any factors, as process 6 does by whole ones. The
+ * result is int(width * xfactor) by int(height * yfactor) pixels, or empty
+ * if either side would be too big for an int. Nearest
+ * neighbour copies source pixel int(j / xfactor) to column j, and likewise
+ * for rows. Bilinear maps the centre of output pixel i to source position
+ * (i + 1/2) * size / new_size - 1/2, held at the first and last pixels at
+ * the edges, and blends the four source pixels around it, with weights in
+ * 256ths, rounded to the nearest value.
+ * @param image   the input image
+ * @param xfactor horizontal scale factor, more than 0
+ * @param yfactor vertical scale factor, more than 0
+ * @param filter  ENLARGE_NEAREST or ENLARGE_BILINEAR
+ * @return the new image
+ */
+Image enlarge(const ImageView& image, double xfactor, double yfactor, int filter = ENLARGE_NEAREST);
+void enlarge(const ImageView& image, double xfactor, double yfactor, int filter, Image& output);
+
+//***************************************************************************************************//
+//                                    OPERATION CHAINS                                               //
+//***************************************************************************************************//
+
+// Default memory budget for one band of scan lines when streaming
+const size_t DEFAULT_BAND_BYTES = 8 << 20;
+
+/**
+ * Parses a whole number for parse_operation()
+ * @param text  the text
+ * @param value receives the number
+ * @return True if the text is a whole number and false otherwise
+ */
+bool parse_int(const std::string& text, int& value);
+
+/**
+ * Parses a process given on the command line, either by name or by menu
+ * number, with its parameters after a colon, for example "grayscale", "3",
+ * "darken:0.5", "rotate:3" or "enlarge:2,3", or a downscale to fit in a box,
+ * "downscale:1024,768", or a square, "downscale:256". An enlargement may have
+ * fractional factors and a filter, "enlarge:1.5,1.5,bilinear". Scaling
+ * factors must be finite, and enlargement factors more than 0 and at most
+ * INT_MAX, the most any image could be enlarged by.
+ * @param text the command line argument
+ * @param op   receives the process
+ * @return True if the text names a process with the parameters it needs and false otherwise
+ */
+bool parse_operation(const std::string& text, Operation& op);
+
+/**
+ * Runs a chain of processes on an image in memory. Runs of per-pixel
+ * processes are applied together in a single pass, fused into the band reads
+ * of a following rotation or enlargement, or applied in place after one, so
+ * rotations and enlargements are the only steps that make a new full-size image.
+ * @param image the input image
+ * @param ops   the processes, in order
+ * @return the new image
+ */
+Image run_operations(const ImageView& image, const std::vector<Operation>& ops);
+
+/**
+ * Applies a chain of per-pixel processes to a BMP file without loading the
+ * whole image. Bands of scan lines are read in file order (bottom to top),
+ * every process is applied to each scan line in a single pass, and the band is
+ * written straight to the output file, so memory use is bounded by the band
+ * size rather than the image size. The output replaces an existing file the
+ * way write_image() does.
+ * @param input      BMP image filename to read
+ * @param output     BMP file name to save the result to (not the input file)
+ * @param ops        the per-pixel processes, in order
+ * @param band_bytes memory to use for a band of scan lines (a band holds at least one)
+ * @return True if successful and false otherwise
+ */
+bool stream_point_ops(const std::string& input, const std::string& output, const std::vector<Operation>& ops,
+                      size_t band_bytes = DEFAULT_BAND_BYTES);
+
+/**
+ * Runs a chain of processes from one BMP file to another. Chains of only
+ * per-pixel processes are streamed with stream_point_ops(). A downscale with
+ * only per-pixel processes before it is done as the file is read, a band of
+ * scan lines at a time, so the full-size image is never held; the rest of the
+ * chain runs on the result. Anything else reads the input in place through a
+ * mapping of the file and runs run_operations().
+ * @param input      BMP image filename to read
+ * @param output     BMP file name to save the result to (not the input file)
+ * @param ops        the processes, in order
+ * @param band_bytes memory to use for a band of scan lines
+ * @return True if successful and false otherwise
+ */
+bool run_pipeline(const std::string& input, const std::string& output, const std::vector<Operation>& ops,
+                  size_t band_bytes = DEFAULT_BAND_BYTES);
+
+/**
+ * Makes a pyramid of smaller and smaller copies of a BMP file, each half the
+ * width and height of the one before, in one pass over the file. Each level
+ * is made from the one before by averaging blocks of 2 by 2 pixels, paired
+ * from the top left; a last odd column or row is averaged with itself.
+ * Scan lines go from level to level as they are made and each level's file
+ * is written as its rows are ready, so only a band of the input and a few
+ * rows of each level are held in memory. The levels replace existing files
+ * the way write_image() does, and only once every level has been written.
+ * @param input      BMP image filename to read
+ * @param output     name for the levels: level N, 1/2^N of the size, is written
+ *                   to this name with "_N" put before the ".bmp"
+ * @param min_size   smallest the longer side of a level may be (at least 1)
+ * @param files      receives the names of the files written, largest first
+ * @param band_bytes memory to use for a band of scan lines of the input
+ * @return True if successful and false otherwise
+ */
+bool write_pyramid(const std::string& input, const std::string& output, int min_size,
+                   std::vector<std::string>& files, size_t band_bytes = DEFAULT_BAND_BYTES);
+
+//***************************************************************************************************//
+//                                    SHARED MEMORY FRAMES                                           //
+//***************************************************************************************************//
+
+// Layouts of the pixels of a frame in shared memory
+enum PixelFormat : uint32_t
+{
+    PIXEL_BGR24 = 0,        // blue, green, red: the layout of an Image
+    PIXEL_BGRA32 = 1        // blue, green, red and a fourth byte that is ignored
+};
+
+// First four bytes of every frame segment, "IPFR" in memory
+const uint32_t SHARED_FRAME_MAGIC = 0x52465049;
+
+// Offset of the pixels in a segment made by SharedFrame::create()
+const size_t SHARED_FRAME_PIXEL_OFFSET = 64;
+
+/**
+ * The descriptor at the start of a POSIX shared-memory segment holding a
+ * frame. The pixels are rows from top to bottom, stride bytes apart, the
+ * first one offset bytes from the start of the segment.
+ */
+struct SharedFrameHeader
+{
+    uint32_t magic;         // SHARED_FRAME_MAGIC
+    uint32_t format;        // a PixelFormat
+    int32_t width;          // in pixels
+    int32_t height;         // in pixels
+    int64_t stride;         // bytes from one row to the next one down
+    uint64_t offset;        // bytes from the start of the segment to the top row
+};
+
+/**
+ * A frame in a POSIX shared-memory segment, mapped so its pixels can be
+ * processed where they are. The engine does not lock the segment: the
+ * producer and consumer must agree between themselves when it may be written.
+ */
+class SharedFrame
+{
+public:
+    SharedFrame();
+    ~SharedFrame();
+
+    SharedFrame(const SharedFrame&) = delete;
+    SharedFrame& operator=(const SharedFrame&) = delete;
+
+    /**
+     * Maps an existing segment, replacing any mapped before
+     * @param name     segment name, as for shm_open() (a leading / is added if missing)
+     * @param writable True to map it for writing too
+     * @return True if the segment holds a valid frame and false otherwise
+     */
+    bool open(const std::string& name, bool writable);
+
+    /**
+     * Maps a segment for a new frame, creating it or growing it as needed, and
+     * writes its descriptor. The pixels are left as they are.
+     * @param name   segment name, as for shm_open() (a leading / is added if missing)
+     * @param width  width in pixels
+     * @param height height in pixels
+     * @param format layout of the pixels
+     * @return True if successful and false otherwise
+     */
+    bool create(const std::string& name, int width, int height, PixelFormat format = PIXEL_BGR24);
+
+    /**
+     * Changes the size or layout of the frame in a segment mapped for
+     * writing, keeping its pixels where they start. Rows are padded to 64
+     * bytes if they fit that way and packed if not.
+     * @param width  width in pixels
+     * @param height height in pixels
+     * @param format layout of the pixels
+     * @return True if the new frame fits in the segment and false otherwise
+     */
+    bool reshape(int width, int height, PixelFormat format);
+
+    /**
+     * Unmaps the segment, which stays in existence for other processes
+     */
+    void close();
+
+    /**
+     * Removes a segment's name, as shm_unlink() does. Mappings of it stay valid.
+     * @param name segment name
+     * @return True if it was removed and false otherwise
+     */
+    static bool remove(const std::string& name);
+
+    bool is_open() const { return map_ != nullptr; }
+    const SharedFrameHeader& header() const { return *reinterpret_cast<const SharedFrameHeader*>(map_); }
+    size_t segment_bytes() const { return size_; }
+
+    // First byte of the top row
+    uint8_t* pixels() { return map_ + header().offset; }
+    const uint8_t* pixels() const { return map_ + header().offset; }
+
+    // View of the pixels in place, or an empty view unless they are PIXEL_BGR24
+    ImageView view() const;
+
+private:
+    bool map(int fd, bool writable);
+    bool valid() const;
+
+    uint8_t* map_;
+    size_t size_;
+};
+
+/**
+ * Runs a chain of processes on a frame in shared memory, with no BMP
+ * encoding, decoding or file I/O. Per-pixel chains on PIXEL_BGR24 frames go
+ * straight from the input pixels to the output pixels. Other chains read
+ * the input in place and copy the result into the output once. Results are
+ * always PIXEL_BGR24.
+ * @param input  segment holding the input frame
+ * @param output segment to receive the result, created or grown as needed,
+ *               or the input segment itself to process the frame in place
+ *               (the result must then fit in it)
+ * @param ops    the processes, in order
+ * @return True if successful and false otherwise
+ */
+bool run_shared(const std::string& input, const std::string& output, const std::vector<Operation>& ops);
+
+//***************************************************************************************************//
+//                                    BATCH JOBS                                                     //
+//***************************************************************************************************//
+
+// One image to process in a batch, and how it went
+struct BatchJob
+{
+    std::string input;
+    std::string output;
+    std::vector<Operation> ops;
+    std::string error;      // why the job failed, or empty if it has not
+    double seconds = 0;
+};
+
+/**
+ * Reads a batch manifest: one job per line, giving the input file, the
+ * output file and the processes, as in "in.bmp out.bmp grayscale darken:0.5".
+ * Blank lines and lines starting with # are skipped.
+ * @param filename the manifest
+ * @param jobs     receives the jobs
+ * @return True if the manifest could be read and false otherwise
+ */
+bool read_manifest(const std::string& filename, std::vector<BatchJob>& jobs);
+
+/**
+ * Makes a job for every file matching a pattern, each writing a file of the
+ * same name in an output directory
+ * @param pattern    shell wildcard pattern for the input files
+ * @param output_dir directory to write the results to
+ * @param words      the processes, as given on the command line
+ * @param jobs       receives the jobs
+ * @return nothing
+ */
+void glob_jobs(const std::string& pattern, const std::string& output_dir, const std::vector<std::string>& words,
+               std::vector<BatchJob>& jobs);
+
+/**
+ * Runs the jobs of a batch on the threads. Each job is a task that
+ * splits its image into bands of rows as it goes, so threads with no image
+ * left to start take bands of the big ones still running.
+ * @param jobs       the jobs, which receive their errors and times
+ * @param band_bytes memory to use for a band of scan lines in each job
+ * @return the number of jobs that failed
+ */
+int run_batch(std::vector<BatchJob>& jobs, size_t band_bytes = DEFAULT_BAND_BYTES);
+
+//***************************************************************************************************//
+//                                    JOB SERVER                                                     //
+//***************************************************************************************************//
+
+// Largest BMP file a client may send the job server inline, unless set otherwise
+const size_t DEFAULT_MAX_INLINE_BYTES = size_t(256) << 20;
+
+/**
+ * Serves jobs on a Unix domain socket until a client asks for a shutdown,
+ * keeping decoded input images, vignette maps and the threads warm between
+ * them. Each request is one line, "INPUT OUTPUT PROCESS..." as in a batch
+ * manifest, and gets one reply line, "ok" with the milliseconds taken to read,
+ * process and write, or "error" with the reason. An INPUT of "-" is followed
+ * by a line giving a byte count and then the bytes of a BMP file; an OUTPUT
+ * of "-" gets the result back the same way after the reply. The requests
+ * "stats" and "shutdown" report on and stop the server. A request that fails,
+ * even for want of memory, gets an "error" reply and the server goes on.
+ * @param socket_path      file name of the socket (an old socket there is replaced)
+ * @param max_inline_bytes largest BMP file a client may send inline
+ * @return True after a shutdown and false if the socket could not be opened
+ */
+bool serve(const std::string& socket_path, size_t max_inline_bytes = DEFAULT_MAX_INLINE_BYTES);
+
+} // namespace imageprocessor
+
+#endif